@@ -17,100 +17,162 @@
 */
 
 /* INCLUDES */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <algorithm>
 #include "image.h"
 
+/*
+*	Function: layoutName
+*	--------------------
+*	Returns the name used for a pixel layout on the command line.
+*/
+const char* layoutName(PixelLayout layout) {
+	switch(layout) {
+		case LAYOUT_PLANAR:
+			return "planar";
+		case LAYOUT_RGBX:
+			return "rgbx";
+		case LAYOUT_TILED:
+			return "tiled";
+		default:
+			return "interleaved";
+	}
+}
+
+/*
+*	Function: ioChunkRows
+*	---------------------
+*	Returns how many rows of the given width make up one chunk of file
+*	I/O, about IO_CHUNK_BYTES but at least one row.
+*/
+int ioChunkRows(int width) {
+	return max(1, (int)(IO_CHUNK_BYTES / ((size_t)width * sizeof(Pixel))));
+}
+
+/*
+*	Function: Constructor
+*	---------------------
+*	Sets up an image without any pixel storage.
+*/
+Image::Image() {
+	storage = NULL;
+	capacity = 0;
+	pixels = NULL;
+	xpixels = NULL;
+	col_offsets = NULL;
+	row_offsets = NULL;
+	for(int c = 0; c < RGB_DEPTH; c++)
+		planes[c] = NULL;
+	layout = LAYOUT_INTERLEAVED;
+	width = height = stride = 0;
+	tile_size = TILE_SIZE;
+	depth = maxcolor = 0;
+}
+
+/*
+*	Function: Destructor
+*	--------------------
+*	Releases the pixel storage.
+*/
+Image::~Image() {
+	clean();
+}
+
 /*
 *   Function: createImageFromFile
 *   -----------------------------
 *   Tries to open the file specified by the given file name
 *   and, if successful, fills the Image object with resolution and
-*   depth information and fills the pixel vector.
+*   depth information and fills the pixel storage, converting the
+*   interleaved file contents into the requested layout.
+*   For mip_level > 0 the image is reduced while loading: every
+*   2^mip_level x 2^mip_level block of the file is box filtered into one
+*   pixel, which yields that level of the image's mip pyramid.
+*   With a pool of several workers, files of at least PARALLEL_IO_BYTES
+*   pixel data are read by all workers at once, each taking a band of
+*   rows with pread: the P6 payload follows the header at a fixed offset.
 */
-bool Image::createImageFromFile(const char* fname) {
+bool Image::createImageFromFile(const char* fname, PixelLayout layout, unsigned int tile_size, unsigned int mip_level, WorkerPool* pool) {
     fstream in;
-    char buf[2];
+    int w, h, mc;
 
-    in.open(fname);
-    if(!in.is_open()) {
-        cerr << "Cannot Open File " << fname << endl;
+    if(!openFile(fname, in, w, h, mc))
         return false;
-    }
-    /* Make sure it is an RGB binary file */
-	in.read(buf, 2);
-    if((buf[0] != 'P') || ((buf[1] != '6') && (buf[1] != '5'))) {
-        cerr << "Wrong Image File Format: " << buf[0] << buf[1] << endl;
-        in.close();
-        return false;
-    }
-    if(buf[1] == '5') {
-        depth = PGM_DEPTH;
-        cerr << "Grayscale Currently Not Supported" << endl;
-        in.close();
-        return false;
-    }
-    else
-        depth = RGB_DEPTH;
-	
-    width = ppmGetInt(in);
-    height = ppmGetInt(in);
-    maxcolor = ppmGetInt(in);
-	x_off = (float)width / 2.0;
-	y_off = (float)height / 2.0;
-	
-    pixels = new Pixel*[width*height];
-    for(int i = 0; i < width * height; i++) {
-        Pixel *p = new Pixel;
-		in.read((char*)p,3);
-		pixels[i] = p;
+	RowSource source = {&in, -1, 0, NULL, NULL, 0, 0, h};
+	size_t payload = (size_t)w * h * sizeof(Pixel);
+	if(pool && pool->getSize() > 1 && payload >= PARALLEL_IO_BYTES) {
+		struct stat st;
+		source.offset = in.tellg();
+		source.fd = open(fname, O_RDONLY | O_CLOEXEC);
+		/* Truncated files keep the sequential path and its behaviour */
+		if(source.fd >= 0 && fstat(source.fd, &st) == 0 && (size_t)st.st_size >= source.offset + payload)
+			source.in = NULL;
+		else
+			pool = NULL;
 	}
+	else
+		pool = NULL;
+	bool loaded = loadRows(w, h, layout, tile_size, mip_level, source, pool);
+	maxcolor = mc;
 
+	if(source.fd >= 0)
+		close(source.fd);
 	in.close();
+    return loaded;
+}
+
+/*
+*   Function: probeFile
+*   -------------------
+*   Reads only the header of the given image file and returns its size,
+*   without loading any pixels.
+*/
+bool Image::probeFile(const char* fname, unsigned int &width, unsigned int &height) {
+    fstream in;
+    int w, h, mc;
+
+    if(!openFile(fname, in, w, h, mc))
+        return false;
+    in.close();
+    width = w;
+    height = h;
     return true;
 }
 
 /*
 *   Function: createImageFromBuffer
 *   -------------------------------
-*   Creates an Image object from a given buffer of pixels.
+*   Creates an Image object from a given buffer of interleaved pixels.
 *   To accomplish this, image size information must be passed along.
+*   mip_level and pool work as for createImageFromFile. Returns false if
+*   the image cannot be allocated.
 */
-void Image::createImageFromBuffer(int width, int height, int depth, Pixel* pels) {
-    this->width = width;
-    this->height = height;
-    this->depth = depth;
-    this->maxcolor = RGB_MAX_COLOR;
-	x_off = (float)width / 2.0;
-	y_off = (float)height / 2.0;
-    pixels = new Pixel*[width*height];
-    for(int i = 0; i < width*height; i++) {
-		Pixel *p = new Pixel;
-		p->r = pels[i].r;
-		p->g = pels[i].g;
-		p->b = pels[i].b;
-		pixels[i] = p;
-	}
+bool Image::createImageFromBuffer(int width, int height, int depth, Pixel* pels, PixelLayout layout, unsigned int tile_size, unsigned int mip_level, WorkerPool* pool) {
+	RowSource source = {NULL, -1, 0, pels, NULL, 0, 0, height};
+	if(pool && (pool->getSize() < 2 || (size_t)width * height * sizeof(Pixel) < PARALLEL_IO_BYTES))
+		pool = NULL;
+	if(!loadRows(width, height, layout, tile_size, mip_level, source, pool))
+		return false;
+	this->depth = depth;
+	return true;
 }
 
 /*
 *	Function: createImageFromTemplate
 *	---------------------------------
-*	Creates an "empty" image whose contents can be filled by using
-*	the setPixelAt function.
+*	Creates an "empty" (black) image whose contents can be filled by using
+*	the setPixelAt function or by writing to the pixel storage directly.
+*	Returns false if the image cannot be allocated.
 */
-void Image::createImageFromTemplate(int width, int height, int depth) {
-	this->width = width;
-	this->height = height;
-	this->depth = depth;
-	this->maxcolor = RGB_MAX_COLOR;
-	x_off = (float)width / 2.0;
-	y_off = (float)height / 2.0;
-	pixels = new Pixel*[width*height];
-	for(int i = 0; i < width*height; i++) {
-		Pixel *p = new Pixel;
-		p->r = p->g = p->b = 0;
-		pixels[i] = p;
-	}
+bool Image::createImageFromTemplate(int width, int height, int depth, PixelLayout layout, unsigned int tile_size) {
+	return allocate(width, height, depth, layout, tile_size);
 }
+
 /*
 *   Function: getWidth
 *   ------------------
@@ -147,6 +209,137 @@ unsigned int Image::getMaxcolor() {
     return maxcolor;
 }
 
+/*
+*   Function: getLayout
+*   -------------------
+*   Getter for the pixel storage layout.
+*/
+PixelLayout Image::getLayout() {
+    return layout;
+}
+
+/*
+*   Function: getStride
+*   -------------------
+*   Getter for the distance in pixels between two consecutive rows of
+*   the pixel storage (includes padding for planar and RGBX images). For
+*   tiled images this is the padded width.
+*/
+unsigned int Image::getStride() {
+    return stride;
+}
+
+/*
+*   Function: getFootprint
+*   ----------------------
+*   Returns the number of bytes used for storing the pixels, padding
+*   included.
+*/
+size_t Image::getFootprint() {
+	switch(layout) {
+		case LAYOUT_PLANAR:
+			return (size_t)RGB_DEPTH * stride * (height + PLANE_PAD);
+		case LAYOUT_RGBX:
+			return sizeof(PixelX) * stride * (height + PLANE_PAD);
+		case LAYOUT_TILED:
+			return sizeof(PixelX) * stride * ((height + PLANE_PAD + tile_size - 1) / tile_size * tile_size);
+		default:
+			return sizeof(Pixel) * stride * height;
+	}
+}
+
+/*
+*   Function: getPixels
+*   -------------------
+*   Returns the interleaved pixel storage, or NULL for planar images.
+*/
+Pixel* Image::getPixels() {
+    return pixels;
+}
+
+/*
+*   Function: getPixelsX
+*   --------------------
+*   Returns the RGBX pixel storage, or NULL for other layouts.
+*/
+PixelX* Image::getPixelsX() {
+    return xpixels;
+}
+
+/*
+*   Function: getPlane
+*   ------------------
+*   Returns the color plane for the given channel (0 = R, 1 = G, 2 = B),
+*   or NULL for interleaved images.
+*/
+uint8_t* Image::getPlane(int channel) {
+    return planes[channel];
+}
+
+/*
+*   Function: getChannel
+*   --------------------
+*   Returns the address of the given channel of the first pixel in the
+*   storage, for any layout. Consecutive pixels of the channel are
+*   getPixelBytes() bytes apart.
+*/
+uint8_t* Image::getChannel(int channel) {
+	if(layout == LAYOUT_PLANAR)
+		return planes[channel];
+	if(layout == LAYOUT_INTERLEAVED)
+		return (uint8_t*)pixels + channel;
+	return (uint8_t*)xpixels + channel;
+}
+
+/*
+*   Function: getPixelBytes
+*   -----------------------
+*   Returns the distance in bytes between two pixels of one channel.
+*/
+unsigned int Image::getPixelBytes() {
+	switch(layout) {
+		case LAYOUT_PLANAR:
+			return 1;
+		case LAYOUT_INTERLEAVED:
+			return sizeof(Pixel);
+		default:
+			return sizeof(PixelX);
+	}
+}
+
+/*
+*   Function: getColumnOffsets
+*   --------------------------
+*   Returns the column offset table of a tiled image, or NULL for other
+*   layouts. Pixel (x,y) is stored at getPixelsX()[col[x] + row[y]]; the
+*   tables cover the PLANE_PAD padding columns and rows as well.
+*/
+const int* Image::getColumnOffsets() {
+    return col_offsets;
+}
+
+/*
+*   Function: getRowOffsets
+*   -----------------------
+*   Returns the row offset table of a tiled image, or NULL for other
+*   layouts.
+*/
+const size_t* Image::getRowOffsets() {
+    return row_offsets;
+}
+
+/*
+*   Function: hasInt32Offsets
+*   -------------------------
+*   Returns true if every pixel index into the storage, padding included,
+*   fits in a signed 32-bit integer. The AVX2 gather kernels, which use
+*   32-bit indices, are limited to such images.
+*/
+bool Image::hasInt32Offsets() {
+	size_t count = (layout == LAYOUT_PLANAR) ? getFootprint() / RGB_DEPTH : getFootprint() / getPixelBytes();
+	return count <= INT_MAX;
+}
+
 /*
 *   Function: getPixelAt
 *   --------------------
@@ -157,7 +350,21 @@ Pixel Image::getPixelAt(int x, int y) {
     Pixel p = {0,0,0};
     if(!(x >= 0 && y >= 0 && x < (int)width && y < (int)height)) 
 		return p;
-    return *(pixels[y*width + x]);
+	if(layout == LAYOUT_PLANAR) {
+		size_t i = (size_t)y * stride + x;
+		p.r = planes[0][i];
+		p.g = planes[1][i];
+		p.b = planes[2][i];
+		return p;
+	}
+	if(layout == LAYOUT_RGBX || layout == LAYOUT_TILED) {
+		PixelX *px = &xpixels[pixelIndexX(x, y)];
+		p.r = px->r;
+		p.g = px->g;
+		p.b = px->b;
+		return p;
+	}
+    return pixels[(size_t)y * stride + x];
 }
 
 /*
@@ -166,14 +373,89 @@ Pixel Image::getPixelAt(int x, int y) {
 *   Sets the pixel value at the specified coordinates.
 */
 void Image::setPixelAt(int x, int y, Pixel* p) {
-	if(x < width && y < height)
-		if(pixels[width*y+x] != NULL)
-			delete(pixels[width*y + x]);
-		Pixel *pel = new Pixel;
-		pel->r = p->r;
-		pel->g = p->g;
-		pel->b = p->b;
-		pixels[width*y + x] = pel;
+	if(!(x >= 0 && y >= 0 && x < (int)width && y < (int)height))
+		return;
+	if(layout == LAYOUT_PLANAR) {
+		size_t i = (size_t)y * stride + x;
+		planes[0][i] = p->r;
+		planes[1][i] = p->g;
+		planes[2][i] = p->b;
+	}
+	else if(layout == LAYOUT_RGBX || layout == LAYOUT_TILED) {
+		PixelX px = {p->r, p->g, p->b, 0};
+		xpixels[pixelIndexX(x, y)] = px;
+	}
+	else
+		pixels[(size_t)y * stride + x] = *p;
+}
+
+/*
+*	Function: getRow
+*	----------------
+*	Copies row y of the image into dest as interleaved pixels.
+*	dest must hold at least width pixels.
+*/
+void Image::getRow(int y, Pixel* dest) {
+	if(layout == LAYOUT_PLANAR) {
+		uint8_t *r = &planes[0][(size_t)y * stride], *g = &planes[1][(size_t)y * stride], *b = &planes[2][(size_t)y * stride];
+		for(int x = 0; x < (int)width; x++) {
+			dest[x].r = r[x];
+			dest[x].g = g[x];
+			dest[x].b = b[x];
+		}
+	}
+	else if(layout == LAYOUT_RGBX) {
+		PixelX *px = &xpixels[(size_t)y * stride];
+		for(int x = 0; x < (int)width; x++) {
+			dest[x].r = px[x].r;
+			dest[x].g = px[x].g;
+			dest[x].b = px[x].b;
+		}
+	}
+	else if(layout == LAYOUT_TILED) {
+		PixelX *px = &xpixels[row_offsets[y]];
+		for(int x = 0; x < (int)width; x++) {
+			dest[x].r = px[col_offsets[x]].r;
+			dest[x].g = px[col_offsets[x]].g;
+			dest[x].b = px[col_offsets[x]].b;
+		}
+	}
+	else
+		memcpy(dest, &pixels[(size_t)y * stride], width * sizeof(Pixel));
+}
+
+/*
+*	Function: setRow
+*	----------------
+*	Fills row y of the image from the interleaved pixels in src.
+*/
+void Image::setRow(int y, Pixel* src) {
+	if(layout == LAYOUT_PLANAR) {
+		uint8_t *r = &planes[0][(size_t)y * stride], *g = &planes[1][(size_t)y * stride], *b = &planes[2][(size_t)y * stride];
+		for(int x = 0; x < (int)width; x++) {
+			r[x] = src[x].r;
+			g[x] = src[x].g;
+			b[x] = src[x].b;
+		}
+	}
+	else if(layout == LAYOUT_RGBX) {
+		PixelX *px = &xpixels[(size_t)y * stride];
+		for(int x = 0; x < (int)width; x++) {
+			px[x].r = src[x].r;
+			px[x].g = src[x].g;
+			px[x].b = src[x].b;
+			px[x].x = 0;
+		}
+	}
+	else if(layout == LAYOUT_TILED) {
+		PixelX *px = &xpixels[row_offsets[y]];
+		for(int x = 0; x < (int)width; x++) {
+			PixelX p = {src[x].r, src[x].g, src[x].b, 0};
+			px[col_offsets[x]] = p;
+		}
+	}
+	else
+		memcpy(&pixels[(size_t)y * stride], src, width * sizeof(Pixel));
 }
 
 /*
@@ -196,15 +478,277 @@ bool Image::containsPixel(Coord* pix) {
 *	Cleans up the memory used for storing the pixel colors.
 */
 void Image::clean() {
-	if(pixels) {
-		for(int i = 0; i < width * height; i++) {
-			if(pixels[i]) {
-				delete(pixels[i]);
-				pixels[i] = NULL;
+	free(storage);
+	storage = NULL;
+	capacity = 0;
+	pixels = NULL;
+	xpixels = NULL;
+	for(int c = 0; c < RGB_DEPTH; c++)
+		planes[c] = NULL;
+	delete [] col_offsets;
+	delete [] row_offsets;
+	col_offsets = NULL;
+	row_offsets = NULL;
+}
+
+/*
+*	Function: allocate
+*	------------------
+*	Sets up size information and provides zeroed pixel storage in the
+*	given layout. All layouts live in one aligned block, which is kept
+*	and reused when the image is created again with a size that fits,
+*	so repeated rotations do not pay for fresh pages. Planar images hold
+*	all three planes in the block, RGBX and tiled images 32-bit pixels.
+*	For planar and RGBX, rows are padded to a multiple of PLANE_ALIGN
+*	bytes, tiled images are padded to whole tiles. All of them carry
+*	PLANE_PAD black rows and columns past the image border, so filter
+*	taps next to the border never leave the buffer. Tiled images also get
+*	the offset tables used to address them. With a pool, the storage is
+*	cleared by all workers. Returns false, leaving an empty 0 x 0 image,
+*	if the storage cannot be allocated or the image is too wide for the
+*	tiled layout.
+*/
+bool Image::allocate(int width, int height, int depth, PixelLayout layout, unsigned int tile_size, WorkerPool* pool) {
+	this->width = width;
+	this->height = height;
+	this->depth = depth;
+	this->maxcolor = RGB_MAX_COLOR;
+	this->layout = layout;
+	this->tile_size = tile_size;
+	x_off = (float)width / 2.0;
+	y_off = (float)height / 2.0;
+	
+	if(layout == LAYOUT_INTERLEAVED)
+		stride = width;
+	else {
+		unsigned int align = (layout == LAYOUT_PLANAR) ? PLANE_ALIGN : PLANE_ALIGN / sizeof(PixelX);
+		if(layout == LAYOUT_TILED)
+			align = tile_size;
+		stride = (width + PLANE_PAD + align - 1) / align * align;
+	}
+	/* Tiled column offsets are 32-bit and span stride * tile_size pixels */
+	if(layout == LAYOUT_TILED && (size_t)stride * tile_size > INT_MAX) {
+		cerr << "Image Too Wide For Tiled Layout" << endl;
+		clean();
+		this->width = this->height = 0;
+		return false;
+	}
+	size_t size = getFootprint();
+	if(size > capacity) {
+		clean();
+		if(posix_memalign(&storage, PLANE_ALIGN, size) != 0) {
+			storage = NULL;
+			cerr << "Cannot Allocate Image Pixels" << endl;
+			this->width = this->height = 0;
+			return false;
+		}
+		capacity = size;
+	}
+	if(pool) {
+		unsigned int parts = pool->getSize();
+		pool->run(parts, [&](unsigned int part, unsigned int worker) {
+			size_t begin = size * part / parts, end = size * (part + 1) / parts;
+			memset((uint8_t*)storage + begin, 0, end - begin);
+		});
+	}
+	else
+		memset(storage, 0, size);
+	
+	pixels = NULL;
+	xpixels = NULL;
+	for(int c = 0; c < RGB_DEPTH; c++)
+		planes[c] = NULL;
+	delete [] col_offsets;
+	delete [] row_offsets;
+	col_offsets = NULL;
+	row_offsets = NULL;
+	if(layout == LAYOUT_INTERLEAVED) {
+		pixels = (Pixel*)storage;
+		return true;
+	}
+	if(layout == LAYOUT_PLANAR) {
+		for(int c = 0; c < RGB_DEPTH; c++)
+			planes[c] = (uint8_t*)storage + c * (size / RGB_DEPTH);
+		return true;
+	}
+	xpixels = (PixelX*)storage;
+	
+	if(layout == LAYOUT_TILED) {
+		/* Split the Z-order index into a column and a row part: the x bits
+		   of the position inside a tile go to the even, the y bits to the
+		   odd bit positions, tile numbers go above them. */
+		col_offsets = new int[width + PLANE_PAD];
+		row_offsets = new size_t[height + PLANE_PAD];
+		int tile_pixels = tile_size * tile_size;
+		size_t tiles_per_row = stride / tile_size;
+		for(int x = 0; x < width + PLANE_PAD; x++) {
+			int morton = 0;
+			for(int bit = 0; (1u << bit) < tile_size; bit++)
+				morton |= ((x >> bit) & 1) << (2 * bit);
+			col_offsets[x] = (x / tile_size) * tile_pixels + morton;
+		}
+		for(int y = 0; y < height + PLANE_PAD; y++) {
+			int morton = 0;
+			for(int bit = 0; (1u << bit) < tile_size; bit++)
+				morton |= ((y >> bit) & 1) << (2 * bit + 1);
+			row_offsets[y] = (y / tile_size) * tiles_per_row * tile_pixels + morton;
+		}
+	}
+	return true;
+}
+
+/*
+*	Function: pixelIndexX
+*	-------------------
+*	Returns the position of pixel (x,y) within the RGBX pixel storage.
+*/
+inline size_t Image::pixelIndexX(int x, int y) {
+	if(layout == LAYOUT_TILED)
+		return row_offsets[y] + col_offsets[x];
+	return (size_t)y * stride + x;
+}
+
+/*
+*	Function: loadRows
+*	------------------
+*	Fills the image from w x h interleaved source pixels, taken row by
+*	row from source and converted into the requested layout. For
+*	mip_level > 0 the rows are box filtered on the fly, so the full
+*	resolution image is never stored. With a pool, the rows are split
+*	into one band per worker; source must then be a file descriptor or
+*	a buffer, which allow reading in any order. Returns false if the
+*	image cannot be allocated.
+*/
+bool Image::loadRows(int w, int h, PixelLayout layout, unsigned int tile_size, unsigned int mip_level, RowSource source, WorkerPool* pool) {
+	int block = 1 << mip_level;
+	if(!allocate((w + block - 1) >> mip_level, (h + block - 1) >> mip_level, RGB_DEPTH, layout, tile_size, pool))
+		return false;
+	if(!pool) {
+		loadBand(0, height, w, h, mip_level, source);
+		return true;
+	}
+	unsigned int bands = min(pool->getSize(), height);
+	pool->run(bands, [&](unsigned int band, unsigned int worker) {
+		loadBand(band * height / bands, (band + 1) * height / bands, w, h, mip_level, source);
+	});
+	return true;
+}
+
+/*
+*	Function: loadBand
+*	------------------
+*	Fills rows first to last-1 of the image for loadRows. With a mip
+*	level these are rows of the reduced image, each made from a block
+*	of source rows. source is a copy owned by the band.
+*/
+void Image::loadBand(int first, int last, int w, int h, unsigned int mip_level, RowSource source) {
+	int block = 1 << mip_level;
+	source.end = min(h, last * block);
+	source.first = source.count = 0;
+	if(source.in)
+		source.buffer = new Pixel[w];
+	else if(source.fd >= 0)
+		source.buffer = new Pixel[(size_t)w * ioChunkRows(w)];
+	if(mip_level == 0) {
+		for(int y = first; y < last; y++)
+			setRow(y, readRow(source, y, w));
+	}
+	else {
+		/* 64-bit sums: a level 16 block adds up 2^32 pixels */
+		uint64_t *sums = new uint64_t[width * RGB_DEPTH];
+		Pixel *level_row = new Pixel[width];
+		for(int ly = first; ly < last; ly++) {
+			int rows = min(block, h - ly * block);
+			memset(sums, 0, width * RGB_DEPTH * sizeof(uint64_t));
+			for(int y = 0; y < rows; y++) {
+				Pixel *row = readRow(source, ly * block + y, w);
+				for(int x = 0; x < w; x++) {
+					uint64_t *sum = &sums[(x >> mip_level) * RGB_DEPTH];
+					sum[0] += row[x].r;
+					sum[1] += row[x].g;
+					sum[2] += row[x].b;
+				}
+			}
+			for(int lx = 0; lx < (int)width; lx++) {
+				/* Blocks at the right and bottom border may be cut off */
+				uint64_t count = (uint64_t)rows * min(block, w - lx * block);
+				uint64_t *sum = &sums[lx * RGB_DEPTH];
+				level_row[lx].r = (sum[0] + count / 2) / count;
+				level_row[lx].g = (sum[1] + count / 2) / count;
+				level_row[lx].b = (sum[2] + count / 2) / count;
 			}
+			setRow(ly, level_row);
+		}
+		delete [] sums;
+		delete [] level_row;
+	}
+	delete [] source.buffer;
+}
+
+/*
+*	Function: readRow
+*	-----------------
+*	Returns source row y of width w for loadBand. Buffer rows are used
+*	in place; stream rows are read into the row buffer, file rows are
+*	read a chunk at a time. Rows the file does not provide read as black.
+*/
+inline Pixel* Image::readRow(RowSource &source, int y, int w) {
+	size_t row_bytes = (size_t)w * sizeof(Pixel);
+	if(source.pels)
+		return &source.pels[(size_t)y * w];
+	if(source.in) {
+		source.in->read((char*)source.buffer, row_bytes);
+		return source.buffer;
+	}
+	if(y < source.first || y >= source.first + source.count) {
+		source.first = y;
+		source.count = max(1, min(ioChunkRows(w), source.end - y));
+		size_t bytes = source.count * row_bytes, done = 0;
+		off_t offset = source.offset + (off_t)y * row_bytes;
+		while(done < bytes) {
+			ssize_t got = pread(source.fd, (char*)source.buffer + done, bytes - done, offset + done);
+			if(got < 0 && errno == EINTR)
+				continue;
+			if(got <= 0)
+				break;
+			done += got;
 		}
-		delete [] pixels;
+		memset((char*)source.buffer + done, 0, bytes - done);
 	}
+	return &source.buffer[(size_t)(y - source.first) * w];
+}
+
+/*
+*   Function: openFile
+*   ------------------
+*   Opens the image file fname, makes sure it is an RGB binary file and
+*   parses its header. On success the stream is left at the first pixel.
+*/
+bool Image::openFile(const char* fname, fstream &in, int &w, int &h, int &mc) {
+    char buf[2];
+
+    in.open(fname);
+    if(!in.is_open()) {
+        cerr << "Cannot Open File " << fname << endl;
+        return false;
+    }
+    /* Make sure it is an RGB binary file */
+	in.read(buf, 2);
+    if((buf[0] != 'P') || ((buf[1] != '6') && (buf[1] != '5'))) {
+        cerr << "Wrong Image File Format: " << buf[0] << buf[1] << endl;
+        in.close();
+        return false;
+    }
+    if(buf[1] == '5') {
+        cerr << "Grayscale Currently Not Supported" << endl;
+        in.close();
+        return false;
+    }
+	
+    w = ppmGetInt(in);
+    h = ppmGetInt(in);
+    mc = ppmGetInt(in);
+    return true;
 }
 
 /*
@@ -30,10 +30,20 @@
 #include <iostream>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include "worker_pool.h"
 
 #define RGB_DEPTH 3
 #define PGM_DEPTH 1
 #define RGB_MAX_COLOR 255
+#define PLANE_ALIGN 32
+#define PLANE_PAD 2
+#define TILE_SIZE 16
+#define TILE_SIZE_MIN 4
+#define TILE_SIZE_MAX 256
+#define PARALLEL_IO_BYTES (16 << 20)	/* smaller images load on one thread */
+#define IO_CHUNK_BYTES (1 << 20)
 
 using namespace std;
 
@@ -46,6 +56,36 @@ typedef struct {
 	uint8_t r, g, b;
 } Pixel;
 
+/*
+*	Structure: PixelX
+*	-----------------
+*	Structure representing an RGB pixel padded to 32 bits, so that a
+*	pixel can be fetched with a single aligned load. x is unused.
+*/
+typedef struct {
+	uint8_t r, g, b, x;
+} PixelX;
+
+/*
+*	Enumeration: PixelLayout
+*	------------------------
+*	In-memory storage layout of the image pixels. Interleaved stores
+*	packed RGB triples, planar stores three separate, aligned R/G/B
+*	planes and RGBX stores aligned 32-bit pixels. Tiled stores RGBX
+*	pixels in square tiles, each tile in Z-order (Morton order), so
+*	that neighbouring pixels share cache lines and pages in both
+*	directions. All layouts but interleaved are padded by PLANE_PAD
+*	zero rows and columns.
+*/
+typedef enum {
+	LAYOUT_INTERLEAVED,
+	LAYOUT_PLANAR,
+	LAYOUT_RGBX,
+	LAYOUT_TILED
+} PixelLayout;
+
+const char* layoutName(PixelLayout layout);
+
 /*
 *	Structure: Coord
 *	-------------
@@ -56,6 +96,27 @@ typedef struct {
 	float y;
 } Coord;
 
+/*
+*	Structure: RowSource
+*	--------------------
+*	Where the rows of a source image come from: the stream in, read in
+*	order, the file fd, read with pread at the payload offset, or the
+*	interleaved pixels pels. File rows are read in chunks of about
+*	IO_CHUNK_BYTES into buffer, which holds rows first to first+count-1;
+*	reads never go past row end, so threads sharing fd each read only
+*	their own band.
+*/
+typedef struct {
+	fstream *in;
+	int fd;
+	off_t offset;
+	Pixel *pels;
+	Pixel *buffer;
+	int first, count, end;
+} RowSource;
+
+int ioChunkRows(int width);
+
 /*
 *	Class: Image
 *	------------
@@ -64,22 +125,51 @@ typedef struct {
 */
 class Image {
 	public:
-        void createImageFromBuffer(int width, int height, int depth, Pixel* pels);
-		bool createImageFromFile(const char *fname);
-		void createImageFromTemplate(int width, int height, int depth);
+		Image();
+		~Image();
+        bool createImageFromBuffer(int width, int height, int depth, Pixel* pels, PixelLayout layout = LAYOUT_INTERLEAVED, unsigned int tile_size = TILE_SIZE, unsigned int mip_level = 0, WorkerPool* pool = NULL);
+		bool createImageFromFile(const char *fname, PixelLayout layout = LAYOUT_INTERLEAVED, unsigned int tile_size = TILE_SIZE, unsigned int mip_level = 0, WorkerPool* pool = NULL);
+		bool probeFile(const char *fname, unsigned int &width, unsigned int &height);
+		bool createImageFromTemplate(int width, int height, int depth, PixelLayout layout = LAYOUT_INTERLEAVED, unsigned int tile_size = TILE_SIZE);
 		Pixel getPixelAt(int x, int y);
 		void setPixelAt(int x, int y, Pixel* p);
+		void getRow(int y, Pixel* dest);
+		void setRow(int y, Pixel* src);
 		bool containsPixel(Coord* pix);
 		unsigned int getWidth();
         unsigned int getHeight();
         unsigned int getDepth();
         unsigned int getMaxcolor();
+		PixelLayout getLayout();
+		unsigned int getStride();
+		size_t getFootprint();
+		Pixel* getPixels();
+		PixelX* getPixelsX();
+		uint8_t* getPlane(int channel);
+		uint8_t* getChannel(int channel);
+		unsigned int getPixelBytes();
+		const int* getColumnOffsets();
+		const size_t* getRowOffsets();
+		bool hasInt32Offsets();
 		void clean();
 	private:
-		Pixel** pixels;
-		unsigned int width, height;
+		void* storage;
+		size_t capacity;
+		Pixel* pixels;
+		PixelX* xpixels;
+		uint8_t* planes[RGB_DEPTH];
+		PixelLayout layout;
+		int *col_offsets;
+		size_t *row_offsets;
+		unsigned int width, height, stride, tile_size;
 		unsigned int depth, maxcolor;
 		float x_off, y_off;
+		bool allocate(int width, int height, int depth, PixelLayout layout, unsigned int tile_size, WorkerPool* pool = NULL);
+		size_t pixelIndexX(int x, int y);
+		bool loadRows(int w, int h, PixelLayout layout, unsigned int tile_size, unsigned int mip_level, RowSource source, WorkerPool* pool);
+		void loadBand(int first, int last, int w, int h, unsigned int mip_level, RowSource source);
+		Pixel* readRow(RowSource &source, int y, int w);
+		bool openFile(const char *fname, fstream &in, int &w, int &h, int &mc);
 		int ppmGetInt(fstream &src);
 		char ppmGetChar(fstream &src);
 };
@@ -23,6 +23,8 @@
 *************************************************************************************/
 #include <sys/time.h>
 #include "rotation_engine.h"
+#include "rotation_daemon.h"
+#include "tuner.h"
 
 #define BAD_EXIT -1;
 #define TIME(x) gettimeofday(&x,NULL)
@@ -30,16 +32,41 @@
 typedef struct timeval timer;
 using namespace std;
 
+/*
+*	Structure: Options
+*	------------------
+*	Optional settings given on the command line after the angle.
+*	profile names the host profile the kernel settings started from,
+*	and is empty if there was none.
+*/
+typedef struct {
+	KernelConfig kernel;
+	unsigned int thumb_w, thumb_h;
+	bool bench;
+	string profile;
+} Options;
+
 /**********************************************************************************
 				FUNCTION PROTOTYPES
 *************************************************************************************/
 long timevaldiff(timer* start, timer* finish);
 string* convertToString(char **in, size_t size);
-bool parseArgs(string* args, unsigned int &angle, string &inname, string &outname);
+bool parseArgs(string* args, size_t count, unsigned int &angle, string &inname, string &outname, Options &opts);
+bool parseOptions(string* args, size_t count, size_t first, Options &opts);
+bool parseLayout(string name, PixelLayout &layout);
+bool parseFilter(string name, FilterMode &filter);
+bool runBenchmark(string srcfile, string destfile, unsigned int angle, Options opts);
 
 /* GLOBAL VARIABLES */
-string usage = "Usage: ./rot <infile> <outfile> <angle>\n";
+string usage = "Usage: ./rot <infile> <outfile> <angle> [--layout interleaved|planar|rgbx|tiled] [--tile <size>]\n"
+               "       [--filter bilinear|bicubic|lanczos] [--threads <n>] [--thumb <w>x<h>] [--bench]\n"
+               "       ./rot --daemon <socket> [--layout ...] [--tile <size>] [--threads <n>]\n"
+               "       ./rot --tune [--filter bilinear|bicubic|lanczos]\n";
 string p_name = "--- IMAGE ROTATION BENCHMARK v0.1 ---\n";
+const PixelLayout layouts[] = {LAYOUT_INTERLEAVED, LAYOUT_PLANAR, LAYOUT_RGBX, LAYOUT_TILED};
+const size_t num_layouts = sizeof(layouts)/sizeof(PixelLayout);
+const FilterMode filters[] = {FILTER_BILINEAR, FILTER_BICUBIC, FILTER_LANCZOS};
+const size_t num_filters = sizeof(filters)/sizeof(FilterMode);
 
 /*
 *	Function: main
@@ -49,24 +76,56 @@ string p_name = "--- IMAGE ROTATION BENCHMARK v0.1 ---\n";
 int main(int argc, char* argv[]) {
     cout << p_name;
 
-    if(argc != 4) {
+    if(argc >= 3 && string(argv[1]) == "--daemon") {
+        Options opts;
+        string *args = convertToString(argv, argc);
+        if(!parseOptions(args, argc, 3, opts)) {
+            cerr << usage;
+            return BAD_EXIT;
+        }
+        RotateDaemon daemon(opts.kernel);
+        return daemon.serve(args[2]) ? 0 : BAD_EXIT;
+    }
+
+    if(argc >= 2 && string(argv[1]) == "--tune") {
+        Options opts;
+        string *args = convertToString(argv, argc);
+        if(!parseOptions(args, argc, 2, opts)) {
+            cerr << usage;
+            return BAD_EXIT;
+        }
+        KernelConfig best = tuneKernel(opts.kernel.filter);
+        string path = profilePath();
+        if(!saveProfile(path, best)) return BAD_EXIT;
+        cout << "Best: layout " << layoutName(best.layout) << ", tile " << best.tile_size
+             << ", threads " << best.threads << endl << "Profile written to " << path << endl;
+        return 0;
+    }
+
+    if(argc < 4) {
 		cerr << usage;
 		return BAD_EXIT;
     }
 
     string srcfile, destfile;
     unsigned int angle;
-    timer start, finish;
+    Options opts;
+    timer start, finish, loaded, written;
     RotateEngine re;
 
     string *args = convertToString(argv, argc);
 
-    if(!parseArgs(args, angle, srcfile, destfile)) {
+    if(!parseArgs(args, argc, angle, srcfile, destfile, opts)) {
         cerr << usage;
         return BAD_EXIT;
     }
 
-    if(!re.init(srcfile, destfile, angle)) return BAD_EXIT;
+    if(opts.bench)
+        return runBenchmark(srcfile, destfile, angle, opts) ? 0 : BAD_EXIT;
+
+    re.setThumbnailSize(opts.thumb_w, opts.thumb_h);
+	TIME(loaded);
+    if(!re.init(srcfile, destfile, angle, opts.kernel)) return BAD_EXIT;
 
 	//re.printRotationState();
 
@@ -75,8 +134,12 @@ int main(int argc, char* argv[]) {
 	TIME(finish);
 	
     re.finish();
+	TIME(written);
 
     cout << "Result: " << (double)timevaldiff(&start, &finish)/1000 << "s" << endl;
+    cout << "Phases: load " << (double)timevaldiff(&loaded, &start)/1000 << "s, rotate "
+         << (double)timevaldiff(&start, &finish)/1000 << "s, write "
+         << (double)timevaldiff(&finish, &written)/1000 << "s" << endl;
 
     return 0;
 }
@@ -100,12 +163,129 @@ string* convertToString(char** in, size_t size) {
 *   -------------------
 *   Extracts the rotation angle as well as the in- and output file names
 *   from the string array args, storing them in the specified variables.
+*   Optional arguments following the angle are stored in opts.
 */
-bool parseArgs(string* args, unsigned int &angle, string &inname, string &outname) {
+bool parseArgs(string* args, size_t count, unsigned int &angle, string &inname, string &outname, Options &opts) {
     const char *tmp = args[3].c_str();
     angle = atoi(tmp) % 360;
     inname = args[1];
     outname = args[2];
+    return parseOptions(args, count, 4, opts);
+}
+
+/*
+*   Function: parseOptions
+*   ----------------------
+*   Stores the optional arguments args[first..count) in opts, starting
+*   from the defaults, overridden by the host profile if one exists.
+*   Shared by the command line tool and the daemon.
+*/
+bool parseOptions(string* args, size_t count, size_t first, Options &opts) {
+    opts.kernel = defaultKernelConfig();
+    opts.profile = profilePath();
+    if(!loadProfile(opts.profile, opts.kernel))
+        opts.profile = "";
+    opts.thumb_w = opts.thumb_h = 0;
+    opts.bench = false;
+    for(size_t i = first; i < count; i++) {
+        if(args[i] == "--layout" && i + 1 < count) {
+            if(!parseLayout(args[++i], opts.kernel.layout))
+                return false;
+        }
+        else if(args[i] == "--tile" && i + 1 < count) {
+            /* Tiles are addressed in Z-order, so the size must be a power of two */
+            unsigned int size = atoi(args[++i].c_str());
+            if(size < TILE_SIZE_MIN || size > TILE_SIZE_MAX || (size & (size - 1)) != 0)
+                return false;
+            opts.kernel.tile_size = size;
+        }
+        else if(args[i] == "--filter" && i + 1 < count) {
+            if(!parseFilter(args[++i], opts.kernel.filter))
+                return false;
+        }
+        else if(args[i] == "--threads" && i + 1 < count) {
+            int threads = atoi(args[++i].c_str());
+            if(threads <= 0 || threads > (int)maxWorkers())
+                return false;
+            opts.kernel.threads = threads;
+        }
+        else if(args[i] == "--thumb" && i + 1 < count) {
+            if(sscanf(args[++i].c_str(), "%ux%u", &opts.thumb_w, &opts.thumb_h) != 2 ||
+               opts.thumb_w == 0 || opts.thumb_h == 0)
+                return false;
+        }
+        else if(args[i] == "--bench")
+            opts.bench = true;
+        else
+            return false;
+    }
+    return true;
+}
+
+/*
+*   Function: parseLayout
+*   ---------------------
+*   Looks up the pixel layout with the given name.
+*/
+bool parseLayout(string name, PixelLayout &layout) {
+    for(size_t i = 0; i < num_layouts; i++) {
+        if(name == layoutName(layouts[i])) {
+            layout = layouts[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+*   Function: parseFilter
+*   ---------------------
+*   Looks up the filter mode with the given name.
+*/
+bool parseFilter(string name, FilterMode &filter) {
+    for(size_t i = 0; i < num_filters; i++) {
+        if(name == filterName(filters[i])) {
+            filter = filters[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+*   Function: runBenchmark
+*   ----------------------
+*   Rotates the input image with every pixel layout and filter, timed
+*   like the tuner's trials, and prints the mean kernel time, the
+*   throughput and the memory used for the source pixels of every
+*   combination. The remaining
+*   settings are taken from opts; they are printed first, and the layout
+*   the host profile picked is marked. Only the result of the configured
+*   layout and filter is written to destfile.
+*/
+bool runBenchmark(string srcfile, string destfile, unsigned int angle, Options opts) {
+    KernelConfig config = opts.kernel;
+    PixelLayout picked = opts.kernel.layout;
+
+    printf("Settings: layout %s, tile %u, threads %u, %s%s\n", layoutName(picked), config.tile_size,
+           config.threads, opts.profile.empty() ? "no host profile" : "profile ", opts.profile.c_str());
+    printf("%-12s %-10s %10s %10s %12s\n", "Layout", "Filter", "Time", "MP/s", "Source MB");
+    for(size_t i = 0; i < num_layouts; i++) {
+        for(size_t f = 0; f < num_filters; f++) {
+            RotateEngine re;
+            re.setVerbose(false);
+            re.setThumbnailSize(opts.thumb_w, opts.thumb_h);
+            config.layout = layouts[i];
+            config.filter = filters[f];
+            if(!re.init(srcfile, destfile, angle, config)) return false;
+            double secs = timeTrial(re);
+            string name = string(layoutName(layouts[i])) + (layouts[i] == picked ? "*" : "");
+            printf("%-12s %-10s %8.3fms %10.2f %12.2f\n", name.c_str(), filterName(filters[f]),
+                   secs * 1000, re.getMegapixels() / secs, (double)re.getFootprint() / 1000000.0);
+            if(layouts[i] == picked && filters[f] == opts.kernel.filter)
+                re.finish();
+        }
+    }
     return true;
 }
 
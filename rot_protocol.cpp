@@ -0,0 +1,92 @@
+/*
+*	"Image Rotate", a program to rotate images by a user-specifyable angle.
+*	
+*	Copyright (C) 2010 Michael Andersch
+*	
+*	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 3 of the License, or (at your option) any later version.
+*	
+*	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*	
+*	You should have received a copy of the GNU General Public License along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+*	File: rot_protocol.cpp
+*	----------------------
+*	Sending and receiving daemon messages along with a file descriptor.
+*/
+
+/* INCLUDES */
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "rot_protocol.h"
+
+/*
+*	Function: sendMessage
+*	---------------------
+*	Sends msg as one packet. If fd is not negative, a copy of the file
+*	descriptor is passed along (SCM_RIGHTS). flags are passed on to
+*	sendmsg; with MSG_DONTWAIT a full socket fails at once with EAGAIN
+*	instead of blocking, and an interrupted send is not retried.
+*/
+bool sendMessage(int sock, const void* msg, size_t len, int fd, int flags) {
+	struct msghdr hdr;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+
+	memset(&hdr, 0, sizeof(hdr));
+	iov.iov_base = (void*)msg;
+	iov.iov_len = len;
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	if(fd >= 0) {
+		memset(control, 0, sizeof(control));
+		hdr.msg_control = control;
+		hdr.msg_controllen = sizeof(control);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	ssize_t sent;
+	do {
+		sent = sendmsg(sock, &hdr, MSG_NOSIGNAL | flags);
+	} while(sent < 0 && errno == EINTR && !(flags & MSG_DONTWAIT));
+	return sent == (ssize_t)len;
+}
+
+/*
+*	Function: recvMessage
+*	---------------------
+*	Receives one packet of up to len bytes into msg. A passed file
+*	descriptor is stored in fd, which is -1 if none came along. Returns
+*	the packet size, 0 if the peer closed the connection or -1 on error.
+*/
+ssize_t recvMessage(int sock, void* msg, size_t len, int* fd) {
+	struct msghdr hdr;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+
+	memset(&hdr, 0, sizeof(hdr));
+	iov.iov_base = msg;
+	iov.iov_len = len;
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+	*fd = -1;
+	ssize_t received;
+	do {
+		received = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+	} while(received < 0 && errno == EINTR);
+	if(received <= 0)
+		return received;
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return received;
+}
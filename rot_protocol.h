@@ -0,0 +1,74 @@
+/*
+*	"Image Rotate", a program to rotate images by a user-specifyable angle.
+*	
+*	Copyright (C) 2010 Michael Andersch
+*	
+*	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 3 of the License, or (at your option) any later version.
+*	
+*	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*	
+*	You should have received a copy of the GNU General Public License along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+*	File: rot_protocol.h
+*	--------------------
+*	Messages exchanged between the rotation daemon and its clients over a
+*	Unix domain socket (SOCK_SEQPACKET, one message per packet). Pixels
+*	never travel through the socket: every request carries a memfd with
+*	the interleaved RGB input at offset 0, and the daemon writes the
+*	interleaved RGB output into the same buffer at out_offset. The memfd
+*	must carry F_SEAL_SHRINK, or the daemon rejects it.
+*/
+
+#ifndef ROT_PROTOCOL_H
+#define ROT_PROTOCOL_H
+
+/**********************************************************************************
+				INCLUDES & DEFINES
+***********************************************************************************/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define ROT_MAGIC 0x31544f52	/* "ROT1" */
+
+#define JOB_OK 0
+#define JOB_BAD_REQUEST 1
+#define JOB_BUFFER_TOO_SMALL 2
+
+/*
+*	Structure: JobRequest
+*	---------------------
+*	A rotation job. thumb_w and thumb_h are 0 for full size output.
+*	buffer_size must equal the size of the memfd.
+*/
+typedef struct {
+	uint32_t magic;
+	uint32_t id;
+	uint32_t width, height;
+	uint32_t angle;
+	uint32_t filter;
+	uint32_t thumb_w, thumb_h;
+	uint64_t out_offset;
+	uint64_t buffer_size;
+} JobRequest;
+
+/*
+*	Structure: JobReply
+*	-------------------
+*	Result of a job: status, output size and the time the daemon spent
+*	on the job in microseconds.
+*/
+typedef struct {
+	uint32_t magic;
+	uint32_t id;
+	int32_t status;
+	uint32_t width, height;
+	uint32_t service_us;
+} JobReply;
+
+bool sendMessage(int sock, const void* msg, size_t len, int fd, int flags);
+ssize_t recvMessage(int sock, void* msg, size_t len, int* fd);
+#endif
@@ -0,0 +1,395 @@
+/*
+*	"Image Rotate", a program to rotate images by a user-specifyable angle.
+*	
+*	Copyright (C) 2010 Michael Andersch
+*	
+*	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 3 of the License, or (at your option) any later version.
+*	
+*	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*	
+*	You should have received a copy of the GNU General Public License along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+*	File: rotation_daemon.cpp
+*	-------------------------
+*	Implementation of the rotation daemon.
+*/
+
+/* INCLUDES */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "rotation_daemon.h"
+
+static volatile sig_atomic_t stop_requested = 0;
+
+/*
+*	Function: requestStop
+*	---------------------
+*	Signal handler making the daemon leave its main loop.
+*/
+static void requestStop(int sig) {
+	stop_requested = 1;
+}
+
+/**********************************************************************************
+				PUBLIC FUNCTIONS
+***********************************************************************************/
+
+/*
+*	Function: Constructor
+*	---------------------
+*	Starts config.threads workers and sets up one engine per worker. The
+*	engines never start workers of their own; large jobs borrow the pool.
+*/
+RotateDaemon::RotateDaemon(KernelConfig config) : pool(config.threads) {
+	this->config = config;
+	this->config.threads = 1;
+	for(unsigned int w = 0; w < pool.getSize(); w++)
+		engines.push_back(new RotateEngine());
+	jobs_served = batches = 0;
+}
+
+/*
+*	Function: Destructor
+*	--------------------
+*	Disconnects all clients and releases the engines.
+*/
+RotateDaemon::~RotateDaemon() {
+	for(size_t k = 0; k < clients.size(); k++)
+		dropClient(k);
+	for(size_t w = 0; w < engines.size(); w++)
+		delete engines[w];
+}
+
+/*
+*	Function: serve
+*	---------------
+*	Listens on the Unix domain socket at path and serves jobs until
+*	SIGINT or SIGTERM arrives. Every poll round receives at most one job
+*	per client; all jobs of a round form a batch. Refuses to start if
+*	path holds anything but a stale socket.
+*/
+bool RotateDaemon::serve(string path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(path.size() >= sizeof(addr.sun_path)) {
+		cerr << "Socket Path Too Long: " << path << endl;
+		return false;
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(listener < 0) {
+		perror("socket");
+		return false;
+	}
+	if(!removeStaleSocket(addr)) {
+		close(listener);
+		return false;
+	}
+	if(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, SOMAXCONN) < 0) {
+		perror("bind");
+		close(listener);
+		return false;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = requestStop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	cout << "Listening on " << path << " with " << pool.getSize() << " worker(s)" << endl;
+
+	vector<struct pollfd> fds;
+	while(!stop_requested) {
+		fds.clear();
+		struct pollfd pfd = {listener, POLLIN, 0};
+		fds.push_back(pfd);
+		for(size_t k = 0; k < clients.size(); k++) {
+			pfd.fd = clients[k].sock;
+			fds.push_back(pfd);
+		}
+		if(poll(&fds[0], fds.size(), -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		vector<Job> batch;
+		for(size_t k = 0; k < clients.size(); k++) {
+			if(fds[k + 1].revents & (POLLIN | POLLHUP | POLLERR))
+				if(!receiveJob(k, batch))
+					dropClient(k);
+		}
+		if(fds[0].revents & POLLIN)
+			acceptClient(listener);
+
+		if(!batch.empty()) {
+			runBatch(batch);
+			for(size_t j = 0; j < batch.size(); j++) {
+				Client &client = clients[batch[j].client];
+				if(client.sock >= 0 && !sendMessage(client.sock, &batch[j].reply, sizeof(JobReply), -1, MSG_DONTWAIT)) {
+					if(errno == EAGAIN || errno == EWOULDBLOCK)
+						cerr << "Client Not Reading Replies, Disconnected" << endl;
+					dropClient(batch[j].client);
+				}
+			}
+		}
+		/* Forget disconnected clients only now, batch refers to them by index */
+		for(size_t k = clients.size(); k-- > 0; )
+			if(clients[k].sock < 0)
+				clients.erase(clients.begin() + k);
+	}
+
+	close(listener);
+	unlink(path.c_str());
+	cout << "Served " << jobs_served << " job(s) in " << batches << " batch(es)" << endl;
+	return true;
+}
+
+/**********************************************************************************
+				PRIVATE FUNCTIONS
+***********************************************************************************/
+
+/*
+*	Function: removeStaleSocket
+*	---------------------------
+*	Clears the way for binding to addr. Only a socket left behind by a
+*	daemon that is no longer running is removed; any other file, or a
+*	socket a live daemon still accepts connections on, is left alone
+*	and makes this return false.
+*/
+bool RotateDaemon::removeStaleSocket(const struct sockaddr_un &addr) {
+	struct stat st;
+	if(lstat(addr.sun_path, &st) < 0)
+		return errno == ENOENT;
+	if(!S_ISSOCK(st.st_mode)) {
+		cerr << "Not A Socket, Refusing To Replace: " << addr.sun_path << endl;
+		return false;
+	}
+	int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(probe < 0) {
+		perror("socket");
+		return false;
+	}
+	bool live = (connect(probe, (const struct sockaddr*)&addr, sizeof(addr)) == 0);
+	close(probe);
+	if(live) {
+		cerr << "Daemon Already Running On " << addr.sun_path << endl;
+		return false;
+	}
+	unlink(addr.sun_path);
+	return true;
+}
+
+/*
+*	Function: acceptClient
+*	----------------------
+*	Accepts a pending connection on the listening socket. Client sockets
+*	are non-blocking: a client that stops reading its replies must not
+*	stall the daemon and everyone else waiting on it.
+*/
+void RotateDaemon::acceptClient(int listener) {
+	int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if(sock < 0) {
+		perror("accept");
+		return;
+	}
+	Client client = {sock, NULL, 0, 0, 0};
+	clients.push_back(client);
+}
+
+/*
+*	Function: receiveJob
+*	--------------------
+*	Receives one request from the given client and appends it to batch.
+*	Returns false if the client has disconnected.
+*/
+bool RotateDaemon::receiveJob(size_t client, vector<Job> &batch) {
+	Job job;
+	int fd;
+	memset(&job.request, 0, sizeof(JobRequest));
+	ssize_t size = recvMessage(clients[client].sock, &job.request, sizeof(JobRequest), &fd);
+	if(size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return true;
+	if(size <= 0) {
+		if(fd >= 0)
+			close(fd);
+		return false;
+	}
+	job.client = client;
+	job.valid = (size == sizeof(JobRequest) && job.request.magic == ROT_MAGIC);
+	if(fd >= 0 && !mapBuffer(clients[client], fd))
+		job.valid = false;
+	if(!clients[client].buffer)
+		job.valid = false;
+	memset(&job.reply, 0, sizeof(JobReply));
+	job.reply.magic = ROT_MAGIC;
+	job.reply.id = job.request.id;
+	job.reply.status = JOB_BAD_REQUEST;
+	batch.push_back(job);
+	return true;
+}
+
+/*
+*	Function: mapBuffer
+*	-------------------
+*	Maps the shared buffer fd of a client. If it is the buffer the client
+*	sent last, the existing mapping is kept, so a client reusing its
+*	buffer pays for neither mmap nor page faults after the first job.
+*	The memfd must be sealed against shrinking: a client truncating a
+*	mapped buffer would make the daemon fault on it. Takes ownership of fd.
+*/
+bool RotateDaemon::mapBuffer(Client &client, int fd) {
+	struct stat st;
+	int seals = fcntl(fd, F_GET_SEALS);
+	if(seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+	if(client.buffer && st.st_dev == client.dev && st.st_ino == client.ino && (size_t)st.st_size == client.size) {
+		close(fd);
+		return true;
+	}
+	if(client.buffer)
+		munmap(client.buffer, client.size);
+	client.buffer = NULL;
+	client.size = 0;
+	void *buffer = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(buffer == MAP_FAILED)
+		return false;
+	client.buffer = (uint8_t*)buffer;
+	client.size = st.st_size;
+	client.dev = st.st_dev;
+	client.ino = st.st_ino;
+	return true;
+}
+
+/*
+*	Function: dropClient
+*	--------------------
+*	Closes the connection of a client and unmaps its buffer. The entry is
+*	removed from the client list by the main loop.
+*/
+void RotateDaemon::dropClient(size_t client) {
+	Client &c = clients[client];
+	if(c.sock >= 0)
+		close(c.sock);
+	if(c.buffer)
+		munmap(c.buffer, c.size);
+	c.sock = -1;
+	c.buffer = NULL;
+	c.size = 0;
+}
+
+/*
+*	Function: runBatch
+*	------------------
+*	Processes a batch of jobs. Jobs of up to BATCH_PIXELS input pixels are
+*	spread over the workers and each run on a single thread, which avoids
+*	splitting tiny images into bands; larger jobs run one after another,
+*	each on all workers.
+*/
+void RotateDaemon::runBatch(vector<Job> &batch) {
+	vector<size_t> small, large;
+	for(size_t j = 0; j < batch.size(); j++) {
+		uint64_t pixels = (uint64_t)batch[j].request.width * batch[j].request.height;
+		if(pixels <= BATCH_PIXELS)
+			small.push_back(j);
+		else
+			large.push_back(j);
+	}
+	if(!small.empty()) {
+		pool.run(small.size(), [&](unsigned int task, unsigned int worker) {
+			processJob(batch[small[task]], engines[worker], false);
+		});
+	}
+	for(size_t j = 0; j < large.size(); j++)
+		processJob(batch[large[j]], engines[0], true);
+	jobs_served += batch.size();
+	batches++;
+}
+
+/*
+*	Function: processJob
+*	--------------------
+*	Runs a single job on the given engine and fills in its reply. With
+*	parallel set, the engine spreads the job over the worker pool. Jobs
+*	whose input exceeds MAX_JOB_PIXELS, or whose output exceeds twice
+*	that (a square at 45 degrees), are refused; a job whose images
+*	cannot be allocated anyway is answered with JOB_BAD_REQUEST.
+*/
+void RotateDaemon::processJob(Job &job, RotateEngine *engine, bool parallel) {
+	struct timespec start, finish;
+	JobRequest &req = job.request;
+	JobReply &reply = job.reply;
+	Client &client = clients[job.client];
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t in_size = (uint64_t)req.width * req.height * sizeof(Pixel);
+	if(!job.valid || req.width == 0 || req.height == 0 || req.width > MAX_JOB_DIMENSION ||
+	   req.height > MAX_JOB_DIMENSION || (uint64_t)req.width * req.height > MAX_JOB_PIXELS ||
+	   req.filter > FILTER_LANCZOS || req.buffer_size != client.size || in_size > client.size || req.out_offset < in_size) {
+		reply.status = JOB_BAD_REQUEST;
+		return;
+	}
+
+	/* Refuse jobs whose output cannot fit before doing any work on them */
+	unsigned int out_w, out_h;
+	engine->setThumbnailSize(req.thumb_w, req.thumb_h);
+	engine->predictOutputSize(req.width, req.height, req.angle % 360, out_w, out_h);
+	reply.width = out_w;
+	reply.height = out_h;
+	if((uint64_t)out_w * out_h > 2 * (uint64_t)MAX_JOB_PIXELS) {
+		reply.status = JOB_BAD_REQUEST;
+		return;
+	}
+	if(!fitsOutput(req.out_offset, out_w, out_h, client.size)) {
+		reply.status = JOB_BUFFER_TOO_SMALL;
+		return;
+	}
+
+	KernelConfig job_config = config;
+	job_config.filter = (FilterMode)req.filter;
+	engine->setWorkerPool(parallel ? &pool : NULL);
+	if(!engine->init((Pixel*)client.buffer, req.width, req.height, req.angle % 360, job_config)) {
+		reply.status = JOB_BAD_REQUEST;
+		return;
+	}
+	engine->run();
+
+	reply.width = engine->getOutputWidth();
+	reply.height = engine->getOutputHeight();
+	if(!fitsOutput(req.out_offset, reply.width, reply.height, client.size))
+		reply.status = JOB_BUFFER_TOO_SMALL;
+	else if(!engine->copyOutput((Pixel*)(client.buffer + req.out_offset)))
+		reply.status = JOB_BAD_REQUEST;
+	else
+		reply.status = JOB_OK;
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	reply.service_us = (finish.tv_sec - start.tv_sec) * 1000000 + (finish.tv_nsec - start.tv_nsec) / 1000;
+}
+
+/*
+*	Function: fitsOutput
+*	--------------------
+*	Returns true if a width x height output image placed at offset lies
+*	within a buffer of the given size. Written so that no sum can wrap.
+*/
+bool RotateDaemon::fitsOutput(uint64_t offset, unsigned int width, unsigned int height, size_t size) {
+	uint64_t out_size = (uint64_t)width * height * sizeof(Pixel);
+	return offset <= size && out_size <= size - offset;
+}
@@ -0,0 +1,96 @@
+/*
+*	"Image Rotate", a program to rotate images by a user-specifyable angle.
+*	
+*	Copyright (C) 2010 Michael Andersch
+*	
+*	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 3 of the License, or (at your option) any later version.
+*	
+*	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*	
+*	You should have received a copy of the GNU General Public License along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+*	File: rotation_daemon.h
+*	-----------------------
+*	Header file for the rotation daemon, a long-running server that
+*	rotates images handed to it through shared memory.
+*/
+
+#ifndef R_DAEMON_H
+#define R_DAEMON_H
+
+/**********************************************************************************
+				INCLUDES & DEFINES
+***********************************************************************************/
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "rotation_engine.h"
+#include "worker_pool.h"
+#include "rot_protocol.h"
+
+#define BATCH_PIXELS (1 << 20)
+#define MAX_JOB_DIMENSION 65536
+#define MAX_JOB_PIXELS (1 << 26)	/* input limit; outputs may be twice as large */
+
+using namespace std;
+
+/*
+*	Structure: Client
+*	-----------------
+*	A connected client and the shared buffer it last sent, which stays
+*	mapped as long as the client keeps sending the same buffer.
+*/
+typedef struct {
+	int sock;
+	uint8_t *buffer;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+} Client;
+
+/*
+*	Structure: Job
+*	--------------
+*	A received request, the client it came from and the reply to it.
+*	valid is false for malformed requests, which are only answered.
+*/
+typedef struct {
+	size_t client;
+	bool valid;
+	JobRequest request;
+	JobReply reply;
+} Job;
+
+/*
+*	Class: RotateDaemon
+*	-------------------
+*	Serves rotation jobs on a Unix domain socket. Worker threads, engines
+*	and their image buffers are kept warm between jobs. Jobs arriving
+*	together are batched: small ones run side by side, one per worker,
+*	large ones run one after another on all workers.
+*/
+class RotateDaemon {
+	public:
+		RotateDaemon(KernelConfig config);
+		~RotateDaemon();
+		bool serve(string path);
+	private:
+		KernelConfig config;
+		WorkerPool pool;
+		vector<RotateEngine*> engines;
+		vector<Client> clients;
+		unsigned long jobs_served, batches;
+		bool removeStaleSocket(const struct sockaddr_un &addr);
+		void acceptClient(int listener);
+		bool receiveJob(size_t client, vector<Job> &batch);
+		bool mapBuffer(Client &client, int fd);
+		void dropClient(size_t client);
+		void runBatch(vector<Job> &batch);
+		void processJob(Job &job, RotateEngine *engine, bool parallel);
+		bool fitsOutput(uint64_t offset, unsigned int width, unsigned int height, size_t size);
+};
+#endif
@@ -18,9 +18,20 @@
 
 /* INCLUDES */
 #include "rotation_engine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+/* x86-64 only: the kernels gather from size_t tables with 8-byte scale */
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
 
 #define PI M_PI
 #define PRECISION 3
+#define MAX_MIP_LEVEL 16
+#define BANDS_PER_WORKER 4
 #define printPoint(a) printf("(%d,%d)\n",(int)a.x,(int)a.y)
 
 using namespace std;
@@ -29,6 +40,36 @@ using namespace std;
 				PUBLIC FUNCTIONS
 ***********************************************************************************/
 
+/*
+*	Function: filterName
+*	--------------------
+*	Returns the name used for a filter mode on the command line.
+*/
+const char* filterName(FilterMode filter) {
+	switch(filter) {
+		case FILTER_BICUBIC:
+			return "bicubic";
+		case FILTER_LANCZOS:
+			return "lanczos";
+		default:
+			return "bilinear";
+	}
+}
+
+/*
+*	Function: defaultKernelConfig
+*	-----------------------------
+*	Returns the kernel settings used when none are given.
+*/
+KernelConfig defaultKernelConfig() {
+	KernelConfig config;
+	config.layout = LAYOUT_INTERLEAVED;
+	config.tile_size = TILE_SIZE;
+	config.filter = FILTER_BILINEAR;
+	config.threads = 1;
+	return config;
+}
+
 /*
 *	Function: Constructor
 *	---------------------
@@ -37,107 +78,223 @@ using namespace std;
 RotateEngine::RotateEngine() {
 	done = false;
 	initialized = false;
+	thumb_w = thumb_h = 0;
+	verbose = true;
+	mip_level = 0;
+	scale = 1.0;
+	pool = shared_pool = own_pool = NULL;
+	scratch = NULL;
+	scratch_count = scratch_width = 0;
+}
+
+/*
+*	Function: Destructor
+*	--------------------
+*	Releases the per-worker scratch rows and the engine's own workers.
+*/
+RotateEngine::~RotateEngine() {
+	releaseScratch();
+	delete own_pool;
 }
 
 /*
 *	Function: init
 *	------------------
 *	Prepares the rotation core for running the kernel. Sets up needed
-*   parameters and loads in the input image.
+*   parameters and loads in the input image in the configured pixel layout.
+*   In thumbnail mode only the mip level the thumbnail is sampled from
+*   gets loaded.
 */
-bool RotateEngine::init(string srcname, string destname, unsigned int angle) {
+bool RotateEngine::init(string srcname, string destname, unsigned int angle, KernelConfig config) {
     this->angle = angle;
+    this->config = config;
     this->srcname = srcname;
+	done = false;
+	buildFilterTable();
     this->destname = destname;
 	c1 = c2 = c3 = c4 = {0.0, 0.0};
-    cout << "Trying to open image file " << srcname << " ... " << endl;
-    if(input.createImageFromFile(srcname.c_str()) != true) return false;
-	// Fill input image corner coordinates
-	float xc = (float)input.getWidth()/2.0;
-	float yc = (float)input.getHeight()/2.0;
-	ul.x = -xc;
-	ul.y = yc;
-	ur.x = xc;
-	ur.y = yc;
-	ll.x = -xc;
-	ll.y = -yc;
-	lr.x = xc;
-	lr.y = -yc;
+	if(verbose)
+		cout << "Trying to open image file " << srcname << " ... " << endl;
+	preparePool();
+	initialized = false;
+	mip_level = 0;
+	if(thumb_w > 0 && thumb_h > 0) {
+		unsigned int width, height;
+		if(!input.probeFile(srcname.c_str(), width, height)) return false;
+		mip_level = chooseMipLevel(width, height);
+	}
+    if(input.createImageFromFile(srcname.c_str(), config.layout, config.tile_size, mip_level, pool) != true) return false;
+	setCorners(input.getWidth(), input.getHeight());
 	initialized = true;
     return true;
 }
 
+/*
+*	Function: init
+*	--------------
+*	Prepares the rotation core for rotating the width x height interleaved
+*	pixels in pels instead of an image file. The pixels are copied into
+*	the input image, converted to the configured layout. Used by the
+*	daemon, which hands out the output through copyOutput. Returns false
+*	if the input image cannot be allocated.
+*/
+bool RotateEngine::init(Pixel* pels, unsigned int width, unsigned int height, unsigned int angle, KernelConfig config) {
+	this->angle = angle;
+	this->config = config;
+	srcname = destname = "";
+	done = false;
+	buildFilterTable();
+	preparePool();
+	c1 = c2 = c3 = c4 = {0.0, 0.0};
+	mip_level = (thumb_w > 0 && thumb_h > 0) ? chooseMipLevel(width, height) : 0;
+	initialized = false;
+	if(!input.createImageFromBuffer(width, height, RGB_DEPTH, pels, config.layout, config.tile_size, mip_level, pool))
+		return false;
+	setCorners(input.getWidth(), input.getHeight());
+	initialized = true;
+	return true;
+}
+
+/*
+*	Function: setWorkerPool
+*	-----------------------
+*	Makes run distribute the target rows over the workers of a pool shared
+*	with other engines, instead of starting config.threads workers of its
+*	own. Passing NULL returns to the engine's own workers. Must be called
+*	before init.
+*/
+void RotateEngine::setWorkerPool(WorkerPool* pool) {
+	shared_pool = pool;
+}
+
+/*
+*	Function: getOutputWidth
+*	------------------------
+*	Returns the width of the output image produced by run.
+*/
+unsigned int RotateEngine::getOutputWidth() {
+	return done ? output.getWidth() : 0;
+}
+
+/*
+*	Function: getOutputHeight
+*	-------------------------
+*	Returns the height of the output image produced by run.
+*/
+unsigned int RotateEngine::getOutputHeight() {
+	return done ? output.getHeight() : 0;
+}
+
+/*
+*	Function: predictOutputSize
+*	---------------------------
+*	Returns the size of the output image init and run would produce for
+*	a width x height source and the given angle with the current
+*	thumbnail size, without loading or rotating anything. Overwrites the
+*	engine's rotation state, so init has to follow before run.
+*/
+void RotateEngine::predictOutputSize(unsigned int width, unsigned int height, unsigned int angle, unsigned int &out_w, unsigned int &out_h) {
+	this->angle = angle;
+	initialized = done = false;
+	unsigned int level = (thumb_w > 0 && thumb_h > 0) ? chooseMipLevel(width, height) : 0;
+	unsigned int block = 1 << level;
+	int target_w, target_h;
+	computeTargetSize((width + block - 1) >> level, (height + block - 1) >> level, target_w, target_h);
+	out_w = target_w;
+	out_h = target_h;
+}
+
+/*
+*	Function: copyOutput
+*	--------------------
+*	Copies the output image into dest as interleaved pixels. Returns false
+*	if called before an output image is produced.
+*/
+bool RotateEngine::copyOutput(Pixel* dest) {
+	if(!done)
+		return false;
+	for(int i = 0; i < (int)output.getHeight(); i++)
+		output.getRow(i, &dest[(size_t)i * output.getWidth()]);
+	return true;
+}
+
+/*
+*	Function: setThumbnailSize
+*	--------------------------
+*	Switches the engine to thumbnail mode: the rotated output is scaled
+*	down to fit into width x height. Must be called before init.
+*/
+void RotateEngine::setThumbnailSize(unsigned int width, unsigned int height) {
+	thumb_w = width;
+	thumb_h = height;
+}
+
+/*
+*	Function: setVerbose
+*	--------------------
+*	Turns the progress messages printed by init on or off.
+*/
+void RotateEngine::setVerbose(bool verbose) {
+	this->verbose = verbose;
+}
+
 /*
 *   Function: run
 *   -------------
 *   Runs the benchmark kernel. When completed successfully, done will be set to true
-*   and output will contain the output image.
+*   and output will contain the output image, stored in the same layout as the input
+*   (RGBX for tiled input, as the output is only written out row by row). If the
+*   output image cannot be allocated, done stays false.
 */
 void RotateEngine::run() {
 	if(!initialized) {
 		fprintf(stderr, "Kernel Called Without Initialization\n");
 		return;
 	}
-	unsigned int height = input.getHeight();
-	unsigned int width = input.getWidth();
+	done = false;
 	unsigned int depth = input.getDepth();
-	float x_offset_source = (float)width / 2.0;
-	float y_offset_source = (float)height / 2.0;
-	
-	Pixel * buffer;
 	
 	/* Steps for rotation:
 		1. Determine target image size by rotating corners
-		2. For each pixel in target image, do
-			- backwards rotation to determine origin location
-			- for origin location, sample and filter 4 closest neighbour pixels
-			- write colour value appropriately
+		2. For each row in target image, do
+			- backwards rotation to determine origin locations
+			- for each origin location, sample and filter 4 closest neighbour pixels
+			  with the kernel specialised for the input pixel layout, or the
+			  surrounding 4x4 / 6x6 pixels with the table-driven filters
+			- write colour values appropriately
 	*/
 	
 	/* STEP 1 */
-	c1 = rotatePoint(&ul, angle);
-	c2 = rotatePoint(&ur, angle);
-	c3 = rotatePoint(&ll, angle);
-	c4 = rotatePoint(&lr, angle);
-	int target_h = computeTargetHeight();
-	int target_w = computeTargetWidth();
-	buffer = new Pixel[target_h * target_w];
+	int target_w, target_h;
+	computeTargetSize(input.getWidth(), input.getHeight(), target_w, target_h);
+	PixelLayout out_layout = (config.layout == LAYOUT_TILED) ? LAYOUT_RGBX : config.layout;
+	if(!output.createImageFromTemplate(target_w, target_h, depth, out_layout))
+		return;
 		
 	/* STEP 2 */
-	unsigned int rev_angle = 360 - angle;
-	float x_offset_target = (float)target_w/2.0;
-	float y_offset_target = (float)target_h/2.0;
+	unsigned int workers = pool ? pool->getSize() : 1;
+	reserveScratch(workers, target_w);
 	
-	for(int i = 0; i < target_h; i++) {
-		for(int j = 0; j < target_w; j++) {
-			/* Find origin pixel for current destination pixel */
-			Coord cur = {-x_offset_target + (float)j, y_offset_target - (float)i};
-			Coord origin_pix = rotatePoint(&cur, rev_angle);
-			/* If original image contains point, sample colour and write back */
-			if(input.containsPixel(&origin_pix)) {
-				int samples[4][2];
-				Pixel colors[4];
-				/* Get sample positions */
-				for(int k = 0; k < 4; k++) {
-					samples[k][0] = (int)(origin_pix.x + x_offset_source) + ((k == 2 || k == 3) ? 1 : 0);
-					samples[k][1] = (int)abs(origin_pix.y - y_offset_source) + ((k == 1 || k == 3) ? 1 : 0);
-				}
-				/* Get colors for samples */
-				for(int k = 0; k < 4; k++) {
-					colors[k] = input.getPixelAt(samples[k][0], samples[k][1]);
-				}
-				/* Filter colors */
-				Pixel final = filter(colors, &origin_pix);
-				/* Write output */
-				buffer[i*target_w + j] = final;
-			}
-			else {
-				/* Pixel is not in source image, write black color */
-				buffer[i*target_w + j] = {0,0,0};
-			}
-		}
+	size_t *clamp_cols = NULL, *clamp_rows = NULL;
+	if(config.filter != FILTER_BILINEAR) {
+		clamp_cols = new size_t[input.getWidth() + 2 * FILTER_MARGIN];
+		clamp_rows = new size_t[input.getHeight() + 2 * FILTER_MARGIN];
+		buildClampTables(clamp_cols, clamp_rows);
 	}
-	output.createImageFromBuffer(target_w, target_h, depth, buffer);
+	
+	if(pool) {
+		/* Split the target into more bands than workers to balance load */
+		unsigned int bands = min((unsigned int)target_h, workers * BANDS_PER_WORKER);
+		pool->run(bands, [&](unsigned int band, unsigned int worker) {
+			filterRows(band * target_h / bands, (band + 1) * target_h / bands, target_w, target_h,
+			           &scratch[worker], clamp_cols, clamp_rows);
+		});
+	}
+	else
+		filterRows(0, target_h, target_w, target_h, &scratch[0], clamp_cols, clamp_rows);
+	
+	delete [] clamp_cols;
+	delete [] clamp_rows;
 	done = true;
 }
 
@@ -164,6 +321,28 @@ void RotateEngine::printRotationState() {
 	fprintf(stdout, "Width: %d\t Height: %d\n", input.getWidth(), input.getHeight());
 	fprintf(stdout, "Pixels: %.2fM\t Angle: %d°\n", (double)(input.getWidth()*input.getHeight())/1000000.0, (int)angle);
 	fprintf(stdout, "Source file: %s\t Dest. File: %s\n", srcname.c_str(), destname.c_str());
+	fprintf(stdout, "Layout: %s\t Tile size: %d\t Filter: %s\t Threads: %d\n", layoutName(config.layout),
+	        (int)config.tile_size, filterName(config.filter), (int)(pool ? pool->getSize() : 1));
+	if(thumb_w > 0 && thumb_h > 0)
+		fprintf(stdout, "Thumbnail: %dx%d\t Mip level: %d\n", (int)thumb_w, (int)thumb_h, (int)mip_level);
+}
+
+/*
+*   Function: getFootprint
+*   ----------------------
+*   Returns the number of bytes the input image pixels occupy in memory.
+*/
+size_t RotateEngine::getFootprint() {
+	return input.getFootprint();
+}
+
+/*
+*   Function: getMegapixels
+*   -----------------------
+*   Returns the size of the input image in megapixels.
+*/
+double RotateEngine::getMegapixels() {
+	return (double)(input.getWidth()*input.getHeight())/1000000.0;
 }
 
 /**********************************************************************************
@@ -191,18 +370,134 @@ bool RotateEngine::writeOutImage() {
         return false;
 	}
     out << output.getWidth() << " " << output.getHeight() << "\n" << output.getMaxcolor() << "\n";
+	size_t payload = (size_t)output.getWidth() * output.getHeight() * sizeof(Pixel);
+	if(pool && pool->getSize() > 1 && payload >= PARALLEL_IO_BYTES) {
+		off_t offset = out.tellp();
+		out.close();
+		return writeRowsParallel(offset);
+	}
+	/* Convert back to interleaved pixels one row at a time */
+	Pixel *row = new Pixel[output.getWidth()];
     for(int i = 0; i < (int)output.getHeight(); i++) {
-        for(int j = 0; j < (int)output.getWidth(); j++) {
-            Pixel p = output.getPixelAt(j, i);
-			out.put(p.r);
-			out.put(p.g);
-			out.put(p.b);
-        }
+		output.getRow(i, row);
+		out.write((char*)row, output.getWidth() * sizeof(Pixel));
     }
+	delete [] row;
 	out.close();
     return true;
 }
 
+/*
+*	Function: writeRowsParallel
+*	---------------------------
+*	Writes the output pixels of writeOutImage behind the header, which
+*	ends at offset, with every worker converting a band of rows back to
+*	interleaved pixels and storing it with pwrite, a chunk at a time.
+*/
+bool RotateEngine::writeRowsParallel(off_t offset) {
+	int fd = open(destname.c_str(), O_WRONLY | O_CLOEXEC);
+	if(fd < 0)
+		return false;
+	int width = output.getWidth(), height = output.getHeight();
+	size_t row_bytes = (size_t)width * sizeof(Pixel);
+	if(ftruncate(fd, offset + (off_t)height * row_bytes) != 0) {
+		close(fd);
+		return false;
+	}
+	unsigned int bands = min(pool->getSize(), (unsigned int)height);
+	vector<char> failed(bands, 0);
+	pool->run(bands, [&](unsigned int band, unsigned int worker) {
+		int first = band * height / bands, last = (band + 1) * height / bands;
+		int chunk = ioChunkRows(width);
+		Pixel *rows = new Pixel[(size_t)width * chunk];
+		for(int y = first; y < last && !failed[band]; y += chunk) {
+			int count = min(chunk, last - y);
+			for(int r = 0; r < count; r++)
+				output.getRow(y + r, &rows[(size_t)r * width]);
+			size_t bytes = count * row_bytes, done = 0;
+			while(done < bytes) {
+				ssize_t put = pwrite(fd, (char*)rows + done, bytes - done, offset + y * row_bytes + done);
+				if(put < 0 && errno == EINTR)
+					continue;
+				if(put <= 0) {
+					failed[band] = 1;
+					break;
+				}
+				done += put;
+			}
+		}
+		delete [] rows;
+	});
+	bool ok = close(fd) == 0;
+	for(unsigned int b = 0; b < bands; b++)
+		ok = ok && !failed[b];
+	return ok;
+}
+
+/*
+*	Function: setCorners
+*	--------------------
+*	Fills the corner coordinates of a source image of the given size,
+*	centered on the origin.
+*/
+void RotateEngine::setCorners(float width, float height) {
+	float xc = width/2.0;
+	float yc = height/2.0;
+	ul.x = -xc;
+	ul.y = yc;
+	ur.x = xc;
+	ur.y = yc;
+	ll.x = -xc;
+	ll.y = -yc;
+	lr.x = xc;
+	lr.y = -yc;
+}
+
+/*
+*	Function: computeTargetSize
+*	---------------------------
+*	Computes the size of the output image for a width x height source,
+*	which for thumbnails is the chosen mip level, and the residual
+*	thumbnail scale. Leaves the rotated corners in c1 to c4.
+*/
+void RotateEngine::computeTargetSize(unsigned int width, unsigned int height, int &target_w, int &target_h) {
+	setCorners(width, height);
+	c1 = rotatePoint(&ul, angle);
+	c2 = rotatePoint(&ur, angle);
+	c3 = rotatePoint(&ll, angle);
+	c4 = rotatePoint(&lr, angle);
+	target_h = computeTargetHeight();
+	target_w = computeTargetWidth();
+	scale = 1.0;
+	if(thumb_w > 0 && thumb_h > 0) {
+		/* Remaining downscale from the mip level to the thumbnail, never magnify */
+		scale = min(1.0f, min((float)thumb_w / target_w, (float)thumb_h / target_h));
+		target_w = max(1, (int)(target_w * scale));
+		target_h = max(1, (int)(target_h * scale));
+	}
+}
+
+/*
+*	Function: chooseMipLevel
+*	------------------------
+*	Picks the mip level of a width x height source the thumbnail is
+*	sampled from: the smallest level that is still at least as large as
+*	the thumbnail needs, so the kernel only ever scales down by less
+*	than 2 and its 2x2 taps do not alias.
+*/
+unsigned int RotateEngine::chooseMipLevel(unsigned int width, unsigned int height) {
+	setCorners(width, height);
+	c1 = rotatePoint(&ul, angle);
+	c2 = rotatePoint(&ur, angle);
+	c3 = rotatePoint(&ll, angle);
+	c4 = rotatePoint(&lr, angle);
+	float s = min((float)thumb_w / computeTargetWidth(), (float)thumb_h / computeTargetHeight());
+	unsigned int level = 0;
+	while(s * (2 << level) <= 1.0 && level < MAX_MIP_LEVEL)
+		level++;
+	return level;
+}
+
 /*
 *	Function: rotatePoint
 *	---------------------
@@ -282,6 +577,588 @@ inline float RotateEngine::findMin(float* seq) {
 
 }
 
+/*
+*	Function: filterRows
+*	--------------------
+*	Produces target rows first to last - 1, using samples as scratch.
+*/
+void RotateEngine::filterRows(int first, int last, int target_w, int target_h, SampleRow* samples,
+		const size_t* clamp_cols, const size_t* clamp_rows) {
+	for(int i = first; i < last; i++) {
+		mapRow(i, target_w, target_h, samples);
+		if(config.filter != FILTER_BILINEAR) {
+			filterRowSeparable(i, target_w, samples, clamp_cols, clamp_rows);
+			continue;
+		}
+		switch(config.layout) {
+			case LAYOUT_PLANAR:
+				filterRowPlanar(i, target_w, samples);
+				break;
+			case LAYOUT_RGBX:
+				filterRowRGBX(i, target_w, samples);
+				break;
+			case LAYOUT_TILED:
+				filterRowTiled(i, target_w, samples);
+				break;
+			default:
+				filterRowInterleaved(i, target_w, samples);
+		}
+	}
+}
+
+/*
+*	Function: reserveScratch
+*	------------------------
+*	Makes sure there are count scratch rows for targets up to width
+*	pixels wide. Scratch rows are kept between runs, so a long-lived
+*	engine reuses warm buffers.
+*/
+void RotateEngine::reserveScratch(unsigned int count, unsigned int width) {
+	if(scratch && count <= scratch_count && width <= scratch_width)
+		return;
+	releaseScratch();
+	scratch = new SampleRow[count];
+	for(unsigned int k = 0; k < count; k++) {
+		SampleRow *samples = &scratch[k];
+		samples->x = new int[width];
+		samples->y = new int[width];
+		samples->offset = new size_t[width];
+		samples->xw = new float[width];
+		samples->yw = new float[width];
+		samples->u = new float[width];
+		samples->v = new float[width];
+		for(int t = 0; t < 4; t++)
+			samples->taps[t] = new uint8_t[width];
+	}
+	scratch_count = count;
+	scratch_width = width;
+}
+
+/*
+*	Function: preparePool
+*	---------------------
+*	Picks the workers run uses: the shared pool if one is set, otherwise
+*	a pool of config.threads workers owned by the engine, which is kept
+*	across runs. One thread means running on the caller without a pool.
+*/
+void RotateEngine::preparePool() {
+	if(shared_pool) {
+		pool = shared_pool;
+		return;
+	}
+	if(config.threads <= 1) {
+		pool = NULL;
+		return;
+	}
+	if(!own_pool || own_pool->getSize() != config.threads) {
+		delete own_pool;
+		own_pool = new WorkerPool(config.threads);
+	}
+	pool = own_pool;
+}
+
+/*
+*	Function: releaseScratch
+*	------------------------
+*	Frees the scratch rows.
+*/
+void RotateEngine::releaseScratch() {
+	if(!scratch)
+		return;
+	for(unsigned int k = 0; k < scratch_count; k++) {
+		SampleRow *samples = &scratch[k];
+		delete [] samples->x;
+		delete [] samples->y;
+		delete [] samples->offset;
+		delete [] samples->xw;
+		delete [] samples->yw;
+		delete [] samples->u;
+		delete [] samples->v;
+		for(int t = 0; t < 4; t++)
+			delete [] samples->taps[t];
+	}
+	delete [] scratch;
+	scratch = NULL;
+	scratch_count = scratch_width = 0;
+}
+
+/*
+*	Function: mapRow
+*	----------------
+*	Performs the backwards rotation for every pixel in row i of the
+*	target image, storing the top left source sample position and the
+*	bilinear weights of each pixel in samples. In thumbnail mode target
+*	pixels are scaled back up to the source resolution first. The
+*	higher-order filters clamp their taps, so for them a pixel counts as
+*	inside whenever its center falls on a source pixel. Thumbnails use
+*	that test with the bilinear filter too, as the strict corner test
+*	would black out a good part of a small output along the border:
+*	they sample at the pixel center, clamped so that all 2x2 taps with
+*	a weight lie inside the source.
+*/
+void RotateEngine::mapRow(int i, int target_w, int target_h, SampleRow* samples) {
+	float x_offset_source = (float)input.getWidth() / 2.0;
+	float y_offset_source = (float)input.getHeight() / 2.0;
+	float x_offset_target = (float)target_w/2.0;
+	float y_offset_target = (float)target_h/2.0;
+	unsigned int rev_angle = 360 - angle;
+	/* Target pixels map to source positions by their upper left corner;
+	   the higher-order filters sample at the pixel center instead */
+	Coord half = {0.5f / scale, -0.5f / scale};
+	Coord center = rotatePoint(&half, rev_angle);
+	bool bilinear = (config.filter == FILTER_BILINEAR);
+	bool thumbnail = (thumb_w > 0 && thumb_h > 0);
+	int x_last = input.getWidth() - 1, y_last = input.getHeight() - 1;
+	float u_max = x_last + 0.5f, v_max = y_last + 0.5f;
+	
+	for(int j = 0; j < target_w; j++) {
+		/* Find origin pixel for current destination pixel */
+		Coord cur = {(-x_offset_target + (float)j) / scale, (y_offset_target - (float)i) / scale};
+		Coord origin_pix = rotatePoint(&cur, rev_angle);
+		/* Source pixel centers lie at half-integer positions */
+		float u = origin_pix.x + center.x + x_offset_source - 0.5;
+		float v = y_offset_source - origin_pix.y - center.y - 0.5;
+		bool inside = (bilinear && !thumbnail) ? input.containsPixel(&origin_pix)
+		                                       : (u >= -0.5f && u < u_max && v >= -0.5f && v < v_max);
+		if(inside && bilinear && thumbnail) {
+			/* filter() blends the taps diagonally, so on a single row
+			   source the x weight would reach into the padding */
+			float cu = max(0.0f, min(u, (float)x_last)), cv = max(0.0f, min(v, (float)y_last));
+			samples->x[j] = min((int)cu, max(x_last - 1, 0));
+			samples->y[j] = min((int)cv, max(y_last - 1, 0));
+			samples->xw[j] = (y_last > 0) ? round(cu - samples->x[j], PRECISION) : 0.0;
+			samples->yw[j] = round(cv - samples->y[j], PRECISION);
+		}
+		else if(inside) {
+			samples->x[j] = (int)(origin_pix.x + x_offset_source);
+			samples->y[j] = (int)abs(origin_pix.y - y_offset_source);
+			samples->xw[j] = round(origin_pix.x - floor(origin_pix.x), PRECISION);
+			samples->yw[j] = round(origin_pix.y - floor(origin_pix.y), PRECISION);
+			samples->u[j] = u;
+			samples->v[j] = v;
+		}
+		else {
+			/* Pixel is not in source image */
+			samples->x[j] = samples->y[j] = -1;
+			samples->xw[j] = samples->yw[j] = 0.0;
+		}
+	}
+}
+
+/*
+*	Function: filterRowInterleaved
+*	------------------------------
+*	Bilinear kernel for interleaved images. Gathers the 4 closest
+*	neighbour pixels of every sample in the row and blends them.
+*/
+void RotateEngine::filterRowInterleaved(int i, int target_w, SampleRow* samples) {
+	Pixel *dest = &output.getPixels()[(size_t)i * output.getStride()];
+	for(int j = 0; j < target_w; j++) {
+		int x = samples->x[j], y = samples->y[j];
+		/* Target image is black already outside the source image */
+		if(x < 0)
+			continue;
+		Pixel colors[4];
+		colors[0] = input.getPixelAt(x, y);
+		colors[1] = input.getPixelAt(x, y + 1);
+		colors[2] = input.getPixelAt(x + 1, y);
+		colors[3] = input.getPixelAt(x + 1, y + 1);
+		dest[j] = filter(colors, samples->xw[j], samples->yw[j]);
+	}
+}
+
+/*
+*	Function: filterRowPlanar
+*	-------------------------
+*	Bilinear kernel for planar images. Resolves the sample offsets once
+*	per row, then works on one color plane at a time: a gather pass
+*	collects the 4 taps of every pixel into contiguous arrays and a
+*	blend pass, free of indirection and branches, filters them with
+*	wide vectors. Pixels outside the source point into the black plane
+*	padding. Blending is done in single precision, so results may differ
+*	from the interleaved kernel by rounding.
+*/
+void RotateEngine::filterRowPlanar(int i, int target_w, SampleRow* samples) {
+	size_t stride = input.getStride();
+	const size_t *offset = samples->offset;
+	mapOffsets(0, target_w, samples);
+	
+	const float * __restrict xw = samples->xw;
+	const float * __restrict yw = samples->yw;
+	uint8_t * __restrict t0 = samples->taps[0];
+	uint8_t * __restrict t1 = samples->taps[1];
+	uint8_t * __restrict t2 = samples->taps[2];
+	uint8_t * __restrict t3 = samples->taps[3];
+	for(int c = 0; c < RGB_DEPTH; c++) {
+		const uint8_t *src = input.getPlane(c);
+		uint8_t * __restrict dest = &output.getPlane(c)[(size_t)i * output.getStride()];
+		/* Gather, in the tap order used by filter() */
+		for(int j = 0; j < target_w; j++) {
+			size_t o = offset[j];
+			t0[j] = src[o];
+			t1[j] = src[o + stride + 1];
+			t2[j] = src[o + stride];
+			t3[j] = src[o + 1];
+		}
+		/* Blend */
+		for(int j = 0; j < target_w; j++) {
+			uint8_t upper = t0[j] * (1.0f - xw[j]) + t1[j] * xw[j];
+			uint8_t lower = t2[j] * (1.0f - xw[j]) + t3[j] * xw[j];
+			dest[j] = upper * (1.0f - yw[j]) + lower * yw[j];
+		}
+	}
+}
+
+#ifdef HAVE_AVX2_KERNELS
+/*
+*	Function: hasAVX2
+*	-----------------
+*	Returns true if the CPU running the program supports AVX2. The gather
+*	kernels are compiled for AVX2 regardless of the build flags and are
+*	only called when this holds, so one binary runs on every x86 host.
+*/
+static bool hasAVX2() {
+	static const bool supported = __builtin_cpu_supports("avx2");
+	return supported;
+}
+
+/*
+*	Function: blendChannel
+*	----------------------
+*	Bilinearly blends the color channel found at bit position shift of
+*	8 RGBX pixels per tap, following the tap order of filter(). Returns
+*	the blended values shifted back into their channel position.
+*/
+AVX2_TARGET static inline __m256i blendChannel(__m256i p0, __m256i p1, __m256i p2, __m256i p3,
+		__m256 wx, __m256 ix, __m256 wy, __m256 iy, int shift) {
+	__m128i count = _mm_cvtsi32_si128(shift);
+	__m256i mask = _mm256_set1_epi32(0xff);
+	__m256 f0 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(p0, count), mask));
+	__m256 f1 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(p1, count), mask));
+	__m256 f2 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(p2, count), mask));
+	__m256 f3 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(p3, count), mask));
+	/* Truncate intermediate results like the scalar kernels do */
+	__m256 upper = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(f0, ix), _mm256_mul_ps(f1, wx))));
+	__m256 lower = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(f2, ix), _mm256_mul_ps(f3, wx))));
+	__m256i v = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(upper, iy), _mm256_mul_ps(lower, wy)));
+	return _mm256_sll_epi32(v, count);
+}
+
+/*
+*	Function: blendTaps
+*	-------------------
+*	Blends the 4 gathered taps of 8 RGBX pixels with the bilinear weights
+*	found at xw and yw into 8 RGBX output pixels.
+*/
+AVX2_TARGET static inline __m256i blendTaps(__m256i p0, __m256i p1, __m256i p2, __m256i p3, const float* xw, const float* yw) {
+	const __m256 one = _mm256_set1_ps(1.0f);
+	__m256 wx = _mm256_loadu_ps(xw);
+	__m256 wy = _mm256_loadu_ps(yw);
+	__m256 ix = _mm256_sub_ps(one, wx);
+	__m256 iy = _mm256_sub_ps(one, wy);
+	__m256i v = blendChannel(p0, p1, p2, p3, wx, ix, wy, iy, 0);
+	v = _mm256_or_si256(v, blendChannel(p0, p1, p2, p3, wx, ix, wy, iy, 8));
+	return _mm256_or_si256(v, blendChannel(p0, p1, p2, p3, wx, ix, wy, iy, 16));
+}
+
+/*
+*	Function: gatherRowRGBX
+*	-----------------------
+*	AVX2 part of filterRowRGBX: filters the output pixels of the row in
+*	groups of 8 and returns how many it has done. Tap offsets are formed
+*	in 32-bit lanes, so the image must have int32 offsets; samples
+*	outside the source point to the pixel at index outside.
+*/
+AVX2_TARGET static int gatherRowRGBX(const PixelX* src, int stride, int outside, const int* sx, const int* sy,
+		const float* xw, const float* yw, int target_w, PixelX* dest) {
+	const int *base = (const int*)src;
+	const __m256i right = _mm256_set1_epi32(1);
+	const __m256i below = _mm256_set1_epi32(stride);
+	const __m256i below_right = _mm256_set1_epi32(stride + 1);
+	const __m256i outside_o = _mm256_set1_epi32(outside);
+	int j = 0;
+	for(; j + 8 <= target_w; j += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)&sx[j]);
+		__m256i y = _mm256_loadu_si256((const __m256i*)&sy[j]);
+		__m256i o = _mm256_add_epi32(_mm256_mullo_epi32(y, below), x);
+		o = _mm256_blendv_epi8(o, outside_o, _mm256_cmpgt_epi32(_mm256_setzero_si256(), x));
+		__m256i p0 = _mm256_i32gather_epi32(base, o, 4);
+		__m256i p1 = _mm256_i32gather_epi32(base, _mm256_add_epi32(o, below_right), 4);
+		__m256i p2 = _mm256_i32gather_epi32(base, _mm256_add_epi32(o, below), 4);
+		__m256i p3 = _mm256_i32gather_epi32(base, _mm256_add_epi32(o, right), 4);
+		_mm256_storeu_si256((__m256i*)&dest[j], blendTaps(p0, p1, p2, p3, &xw[j], &yw[j]));
+	}
+	return j;
+}
+
+/*
+*	Function: gatherRowOffsets
+*	--------------------------
+*	Looks up the row offsets of 8 rows in the 64-bit table of a tiled
+*	image and narrows them to 32-bit lanes, which is exact for images
+*	with int32 offsets.
+*/
+AVX2_TARGET static inline __m256i gatherRowOffsets(const size_t* rows, __m256i y) {
+	const __m256i low_halves = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	__m256i lo = _mm256_i32gather_epi64((const long long*)rows, _mm256_castsi256_si128(y), 8);
+	__m256i hi = _mm256_i32gather_epi64((const long long*)rows, _mm256_extracti128_si256(y, 1), 8);
+	lo = _mm256_permutevar8x32_epi32(lo, low_halves);
+	hi = _mm256_permutevar8x32_epi32(hi, low_halves);
+	return _mm256_inserti128_si256(lo, _mm256_castsi256_si128(hi), 1);
+}
+
+/*
+*	Function: gatherRowTiled
+*	------------------------
+*	AVX2 part of filterRowTiled: filters the output pixels of the row in
+*	groups of 8 and returns how many it has done.
+*/
+AVX2_TARGET static int gatherRowTiled(const PixelX* src, const int* cols, const size_t* rows, const int* sx,
+		const int* sy, const float* xw, const float* yw, int width, int height, int target_w, PixelX* dest) {
+	const int *base = (const int*)src;
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i outside_x = _mm256_set1_epi32(width);
+	const __m256i outside_y = _mm256_set1_epi32(height);
+	int j = 0;
+	for(; j + 8 <= target_w; j += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)&sx[j]);
+		__m256i y = _mm256_loadu_si256((const __m256i*)&sy[j]);
+		__m256i outside = _mm256_cmpgt_epi32(_mm256_setzero_si256(), x);
+		x = _mm256_blendv_epi8(x, outside_x, outside);
+		y = _mm256_blendv_epi8(y, outside_y, outside);
+		__m256i c0 = _mm256_i32gather_epi32(cols, x, 4);
+		__m256i c1 = _mm256_i32gather_epi32(cols, _mm256_add_epi32(x, one), 4);
+		__m256i r0 = gatherRowOffsets(rows, y);
+		__m256i r1 = gatherRowOffsets(rows, _mm256_add_epi32(y, one));
+		__m256i p0 = _mm256_i32gather_epi32(base, _mm256_add_epi32(c0, r0), 4);
+		__m256i p1 = _mm256_i32gather_epi32(base, _mm256_add_epi32(c1, r1), 4);
+		__m256i p2 = _mm256_i32gather_epi32(base, _mm256_add_epi32(c0, r1), 4);
+		__m256i p3 = _mm256_i32gather_epi32(base, _mm256_add_epi32(c1, r0), 4);
+		_mm256_storeu_si256((__m256i*)&dest[j], blendTaps(p0, p1, p2, p3, &xw[j], &yw[j]));
+	}
+	return j;
+}
+#endif
+
+/*
+*	Function: blendPixel
+*	--------------------
+*	Scalar counterpart of blendTaps for a single RGBX pixel.
+*/
+static inline void blendPixel(const PixelX* t0, const PixelX* t1, const PixelX* t2, const PixelX* t3,
+		float xw, float yw, PixelX* dest) {
+	const uint8_t *a = (const uint8_t*)t0, *b = (const uint8_t*)t1;
+	const uint8_t *c = (const uint8_t*)t2, *d = (const uint8_t*)t3;
+	uint8_t *out = (uint8_t*)dest;
+	for(int k = 0; k < RGB_DEPTH; k++) {
+		uint8_t upper = a[k] * (1.0f - xw) + b[k] * xw;
+		uint8_t lower = c[k] * (1.0f - xw) + d[k] * xw;
+		out[k] = upper * (1.0f - yw) + lower * yw;
+	}
+	out[3] = 0;
+}
+
+/*
+*	Function: filterRowRGBX
+*	-----------------------
+*	Bilinear kernel for RGBX images. Every tap is a single aligned 32-bit
+*	load; with AVX2 the taps of 8 pixels are fetched by one gather
+*	instruction each and all channels are blended in vector registers.
+*	Pixels outside the source point into the black padding.
+*/
+void RotateEngine::filterRowRGBX(int i, int target_w, SampleRow* samples) {
+	size_t stride = input.getStride();
+	const size_t *offset = samples->offset;
+	const float *xw = samples->xw, *yw = samples->yw;
+	const PixelX *src = input.getPixelsX();
+	PixelX *dest = &output.getPixelsX()[(size_t)i * output.getStride()];
+	
+	int j = 0;
+#ifdef HAVE_AVX2_KERNELS
+	if(hasAVX2() && input.hasInt32Offsets())
+		j = gatherRowRGBX(src, stride, input.getHeight() * stride + input.getWidth(), samples->x, samples->y,
+		                  xw, yw, target_w, dest);
+#endif
+	mapOffsets(j, target_w, samples);
+	for(; j < target_w; j++) {
+		size_t o = offset[j];
+		blendPixel(&src[o], &src[o + stride + 1], &src[o + stride], &src[o + 1], xw[j], yw[j], &dest[j]);
+	}
+}
+
+/*
+*	Function: filterRowTiled
+*	------------------------
+*	Bilinear kernel for tiled images. Tap addresses are the sum of a
+*	column and a row offset looked up in the tables of the input image,
+*	so sampling costs no per-pixel bit interleaving. Pixels outside the
+*	source sample the black padding at (width, height).
+*/
+void RotateEngine::filterRowTiled(int i, int target_w, SampleRow* samples) {
+	const int *cols = input.getColumnOffsets();
+	const size_t *rows = input.getRowOffsets();
+	const int *sx = samples->x, *sy = samples->y;
+	const float *xw = samples->xw, *yw = samples->yw;
+	const PixelX *src = input.getPixelsX();
+	PixelX *dest = &output.getPixelsX()[(size_t)i * output.getStride()];
+	int width = input.getWidth(), height = input.getHeight();
+	
+	int j = 0;
+#ifdef HAVE_AVX2_KERNELS
+	if(hasAVX2() && input.hasInt32Offsets())
+		j = gatherRowTiled(src, cols, rows, sx, sy, xw, yw, width, height, target_w, dest);
+#endif
+	for(; j < target_w; j++) {
+		int x = sx[j], y = sy[j];
+		if(x < 0) {
+			x = width;
+			y = height;
+		}
+		blendPixel(&src[cols[x] + rows[y]], &src[cols[x + 1] + rows[y + 1]],
+		           &src[cols[x] + rows[y + 1]], &src[cols[x + 1] + rows[y]], xw[j], yw[j], &dest[j]);
+	}
+}
+
+/*
+*	Function: filterRowSeparable
+*	----------------------------
+*	Bicubic and Lanczos kernel, working on any input layout. The subpixel
+*	phase of each sample is quantised to FILTER_PHASES steps and the tap
+*	weights are looked up in the precomputed fixed-point table. Each tap
+*	row is accumulated in integers, reduced to 6 fractional bits, and the
+*	rows are then accumulated the same way vertically. Taps outside the
+*	source are clamped to the border through the cols/rows tables.
+*/
+void RotateEngine::filterRowSeparable(int i, int target_w, SampleRow* samples, const size_t* cols, const size_t* rows) {
+	const uint8_t *src[RGB_DEPTH];
+	uint8_t *dest[RGB_DEPTH];
+	int spb = input.getPixelBytes(), dpb = output.getPixelBytes();
+	for(int c = 0; c < RGB_DEPTH; c++) {
+		src[c] = input.getChannel(c);
+		dest[c] = output.getChannel(c) + (size_t)i * output.getStride() * dpb;
+	}
+	int n = filter_taps, first = filter_taps / 2 - 1;
+	size_t x_off[FILTER_MAX_TAPS], y_off[FILTER_MAX_TAPS];
+	
+	for(int j = 0; j < target_w; j++) {
+		/* Target image is black already outside the source image */
+		if(samples->x[j] < 0)
+			continue;
+		float u = samples->u[j], v = samples->v[j];
+		int x0 = (int)floor(u), y0 = (int)floor(v);
+		const int *wx = filter_weights[(int)((u - x0) * FILTER_PHASES + 0.5f)];
+		const int *wy = filter_weights[(int)((v - y0) * FILTER_PHASES + 0.5f)];
+		for(int t = 0; t < n; t++) {
+			x_off[t] = cols[x0 - first + t + FILTER_MARGIN] * spb;
+			y_off[t] = rows[y0 - first + t + FILTER_MARGIN] * spb;
+		}
+		for(int c = 0; c < RGB_DEPTH; c++) {
+			int acc = 0;
+			for(int ty = 0; ty < n; ty++) {
+				const uint8_t *line = src[c] + y_off[ty];
+				int h = 0;
+				for(int tx = 0; tx < n; tx++)
+					h += wx[tx] * line[x_off[tx]];
+				acc += wy[ty] * ((h + (1 << 7)) >> 8);
+			}
+			int value = (acc + (1 << (2 * FILTER_BITS - 9))) >> (2 * FILTER_BITS - 8);
+			dest[c][j * dpb] = (value < 0) ? 0 : ((value > RGB_MAX_COLOR) ? RGB_MAX_COLOR : value);
+		}
+	}
+}
+
+/*
+*	Function: filterKernel
+*	----------------------
+*	Evaluates the continuous reconstruction filter at distance d from
+*	the sample position. Only used for building the weight tables.
+*/
+static double filterKernel(FilterMode filter, double d) {
+	d = fabs(d);
+	if(filter == FILTER_LANCZOS) {
+		if(d < 1e-8)
+			return 1.0;
+		if(d >= 3.0)
+			return 0.0;
+		double x = PI * d;
+		return 3.0 * sin(x) * sin(x / 3.0) / (x * x);
+	}
+	/* Catmull-Rom spline, a = -0.5 */
+	const double a = -0.5;
+	if(d < 1.0)
+		return ((a + 2.0) * d - (a + 3.0)) * d * d + 1.0;
+	if(d < 2.0)
+		return ((a * d - 5.0 * a) * d + 8.0 * a) * d - 4.0 * a;
+	return 0.0;
+}
+
+/*
+*	Function: buildFilterTable
+*	--------------------------
+*	Precomputes the tap weights of the configured higher-order filter for
+*	every quantised subpixel phase, in FILTER_BITS fixed point. Rounding
+*	errors are folded into the center tap so every phase sums to exactly
+*	one, which keeps flat areas flat.
+*/
+void RotateEngine::buildFilterTable() {
+	filter_taps = (config.filter == FILTER_LANCZOS) ? 6 : 4;
+	if(config.filter == FILTER_BILINEAR)
+		return;
+	int first = filter_taps / 2 - 1;
+	for(int p = 0; p <= FILTER_PHASES; p++) {
+		double frac = (double)p / FILTER_PHASES;
+		double w[FILTER_MAX_TAPS], sum = 0.0;
+		for(int t = 0; t < filter_taps; t++) {
+			w[t] = filterKernel(config.filter, t - first - frac);
+			sum += w[t];
+		}
+		int total = 0;
+		for(int t = 0; t < filter_taps; t++) {
+			filter_weights[p][t] = (int)floor(w[t] / sum * (1 << FILTER_BITS) + 0.5);
+			total += filter_weights[p][t];
+		}
+		filter_weights[p][first + (frac > 0.5 ? 1 : 0)] += (1 << FILTER_BITS) - total;
+	}
+}
+
+/*
+*	Function: buildClampTables
+*	--------------------------
+*	Fills the tap address tables of the higher-order filters for source
+*	columns and rows from -FILTER_MARGIN to size + FILTER_MARGIN. Entries
+*	are clamped to the image border and given in pixels, so that pixel
+*	(x,y) is found at index cols[x + FILTER_MARGIN] + rows[y + FILTER_MARGIN]
+*	of any layout.
+*/
+void RotateEngine::buildClampTables(size_t* cols, size_t* rows) {
+	int width = input.getWidth(), height = input.getHeight();
+	const int *tile_cols = input.getColumnOffsets();
+	const size_t *tile_rows = input.getRowOffsets();
+	for(int x = -FILTER_MARGIN; x < width + FILTER_MARGIN; x++) {
+		int xc = min(max(x, 0), width - 1);
+		cols[x + FILTER_MARGIN] = tile_cols ? tile_cols[xc] : xc;
+	}
+	for(int y = -FILTER_MARGIN; y < height + FILTER_MARGIN; y++) {
+		int yc = min(max(y, 0), height - 1);
+		rows[y + FILTER_MARGIN] = tile_rows ? tile_rows[yc] : (size_t)yc * input.getStride();
+	}
+}
+
+/*
+*	Function: mapOffsets
+*	--------------------
+*	Turns the sample positions first to target_w-1 of a row into pixel
+*	offsets into the padded input storage. Pixels outside the source
+*	image point to the first padding pixel past the last row, whose taps
+*	are all black.
+*/
+void RotateEngine::mapOffsets(int first, int target_w, SampleRow* samples) {
+	size_t stride = input.getStride();
+	size_t outside = input.getHeight() * stride + input.getWidth();
+	for(int j = first; j < target_w; j++)
+		samples->offset[j] = (samples->x[j] < 0) ? outside : samples->y[j] * stride + samples->x[j];
+}
+
 /*
 *	Function: filter
 *	---------------------
@@ -289,11 +1166,7 @@ inline float RotateEngine::findMin(float* seq) {
 *	color values into a final pixel. The algorithm used is bilinear
 *	filtering, using the sample position as a weight for color blend.
 */
-inline Pixel RotateEngine::filter(Pixel* colors, Coord* sample_pos) {
-	uint32_t r, g, b;
-	float x_weight = round(sample_pos->x - floor(sample_pos->x), PRECISION);
-	float y_weight = round(sample_pos->y - floor(sample_pos->y), PRECISION);
-	
+inline Pixel RotateEngine::filter(Pixel* colors, float x_weight, float y_weight) {
 	Pixel sample_v_upper = interpolateLinear(&colors[0], &colors[3], x_weight);
 	Pixel sample_v_lower = interpolateLinear(&colors[1], &colors[2], x_weight);
 	Pixel sample_h = interpolateLinear(&sample_v_upper, &sample_v_lower, y_weight);
@@ -29,9 +29,61 @@
 #include <cmath>
 #include <float.h>
 #include "image.h"
+#include "worker_pool.h"
+
+#define FILTER_PHASES 64
+#define FILTER_MAX_TAPS 6
+#define FILTER_BITS 14
+#define FILTER_MARGIN 4
 
 using namespace std;
 
+/*
+*	Enumeration: FilterMode
+*	-----------------------
+*	Reconstruction filter used for sampling the source image: 2x2
+*	bilinear, 4x4 bicubic (Catmull-Rom) or 6x6 Lanczos (a = 3).
+*/
+typedef enum {
+	FILTER_BILINEAR,
+	FILTER_BICUBIC,
+	FILTER_LANCZOS
+} FilterMode;
+
+const char* filterName(FilterMode filter);
+
+/*
+*	Structure: SampleRow
+*	--------------------
+*	Source sample positions and bilinear weights for one row of the
+*	output image. x and y are -1 for output pixels that lie outside
+*	the source image; u and v hold the exact source position in pixels
+*	for the higher-order filters. offset and taps are scratch space for
+*	the layout kernels.
+*/
+typedef struct {
+	int *x, *y;
+	size_t *offset;
+	float *xw, *yw, *u, *v;
+	uint8_t *taps[4];
+} SampleRow;
+
+/*
+*	Structure: KernelConfig
+*	-----------------------
+*	Tunable settings of the rotation kernel: the pixel layout the input
+*	image is stored in, the tile size used by the tiled layout, the
+*	reconstruction filter and the number of threads run uses.
+*/
+typedef struct {
+	PixelLayout layout;
+	unsigned int tile_size;
+	FilterMode filter;
+	unsigned int threads;
+} KernelConfig;
+
+KernelConfig defaultKernelConfig();
+
 /*
 *	Class: RotateEngine
 *	-------------------
@@ -41,24 +93,61 @@ using namespace std;
 class RotateEngine {
     public:
 		RotateEngine();
+		~RotateEngine();
 		void run();
 		void finish();
-		bool init(string srcname, string destname, unsigned int angle);
+		bool init(string srcname, string destname, unsigned int angle, KernelConfig config = defaultKernelConfig());
+		bool init(Pixel* pels, unsigned int width, unsigned int height, unsigned int angle, KernelConfig config);
         void printRotationState();
+		void setThumbnailSize(unsigned int width, unsigned int height);
+		void setVerbose(bool verbose);
+		void setWorkerPool(WorkerPool* pool);
+		size_t getFootprint();
+		double getMegapixels();
+		unsigned int getOutputWidth();
+		unsigned int getOutputHeight();
+		void predictOutputSize(unsigned int width, unsigned int height, unsigned int angle, unsigned int &out_w, unsigned int &out_h);
+		bool copyOutput(Pixel* dest);
     private:
         string srcname, destname;
 		Image input, output;
 		unsigned int angle;
-        bool initialized, done;
+		KernelConfig config;
+		unsigned int thumb_w, thumb_h, mip_level;
+		float scale;
+		WorkerPool *pool, *shared_pool, *own_pool;
+		SampleRow* scratch;
+		unsigned int scratch_count, scratch_width;
+		int filter_taps;
+		int filter_weights[FILTER_PHASES + 1][FILTER_MAX_TAPS];
+        bool initialized, done, verbose;
 		Coord ul, ur, ll, lr, c1, c2, c3, c4;
         bool writeOutImage();
+		bool writeRowsParallel(off_t offset);
+		void setCorners(float width, float height);
+		unsigned int chooseMipLevel(unsigned int width, unsigned int height);
+		void computeTargetSize(unsigned int width, unsigned int height, int &target_w, int &target_h);
 		Coord rotatePoint(Coord *pt, unsigned int angle);
 		double round(double num, int digits);
 		int computeTargetHeight();
 		int computeTargetWidth();
 		float findMax(float* seq);
 		float findMin(float* seq);
-		Pixel filter(Pixel* colors, Coord* sample_pos);
+		void filterRows(int first, int last, int target_w, int target_h, SampleRow* samples,
+		                const size_t* clamp_cols, const size_t* clamp_rows);
+		void reserveScratch(unsigned int count, unsigned int width);
+		void releaseScratch();
+		void preparePool();
+		void mapRow(int row, int target_w, int target_h, SampleRow* samples);
+		void filterRowInterleaved(int row, int target_w, SampleRow* samples);
+		void filterRowPlanar(int row, int target_w, SampleRow* samples);
+		void filterRowRGBX(int row, int target_w, SampleRow* samples);
+		void filterRowTiled(int row, int target_w, SampleRow* samples);
+		void mapOffsets(int first, int target_w, SampleRow* samples);
+		void filterRowSeparable(int row, int target_w, SampleRow* samples, const size_t* cols, const size_t* rows);
+		void buildFilterTable();
+		void buildClampTables(size_t* cols, size_t* rows);
+		Pixel filter(Pixel* colors, float x_weight, float y_weight);
 		Pixel interpolateLinear(Pixel* a, Pixel* b, float weight);
 };
 
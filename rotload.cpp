@@ -0,0 +1,295 @@
+/*
+*	"Image Rotate", a program to rotate images by a user-specifyable angle.
+*	
+*	Copyright (C) 2010 Michael Andersch
+*	
+*	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 3 of the License, or (at your option) any later version.
+*	
+*	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*	
+*	You should have received a copy of the GNU General Public License along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+*	File: rotload.cpp
+*	-----------------
+*	Load generator for the rotation daemon. Every client thread owns a
+*	shared memory buffer holding a synthetic image, sends a stream of
+*	rotation jobs over its own connection and records the latency of each.
+*	Prints latency percentiles and the overall request rate.
+*/
+
+/**********************************************************************************
+				INCLUDES & DEFINES
+*************************************************************************************/
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "rot_protocol.h"
+
+#define BAD_EXIT -1;
+#define PAGE_SIZE 4096
+#define MAX_DIMENSION 65536	/* the daemon's MAX_JOB_DIMENSION */
+#define MAX_REQUESTS 100000000
+#define MAX_CLIENTS 1024
+
+using namespace std;
+
+/*
+*	Structure: LoadConfig
+*	---------------------
+*	The job every client sends and how often.
+*/
+typedef struct {
+	string socket;
+	unsigned int width, height;
+	unsigned int requests, clients;
+	unsigned int angle, filter;
+	unsigned int thumb_w, thumb_h;
+} LoadConfig;
+
+/*
+*	Structure: ClientStats
+*	----------------------
+*	Latencies in microseconds and the number of failed jobs of one client.
+*/
+typedef struct {
+	vector<double> latencies;
+	unsigned int errors;
+	double service_us;
+} ClientStats;
+
+/**********************************************************************************
+				FUNCTION PROTOTYPES
+*************************************************************************************/
+bool parseArgs(int argc, char* argv[], LoadConfig &config);
+bool parseCount(const char* arg, int max, unsigned int &value);
+void runClient(const LoadConfig &config, unsigned int client, ClientStats &stats);
+double now();
+
+string usage = "Usage: ./rotload <socket> <width> <height> [--requests <n>] [--clients <n>] [--angle <a>]\n"
+               "       [--filter bilinear|bicubic|lanczos] [--thumb <w>x<h>]\n";
+const char* filter_names[] = {"bilinear", "bicubic", "lanczos"};
+
+/*
+*	Function: main
+*	--------------
+*	The program main function.
+*/
+int main(int argc, char* argv[]) {
+	LoadConfig config;
+	if(!parseArgs(argc, argv, config)) {
+		cerr << usage;
+		return BAD_EXIT;
+	}
+
+	vector<ClientStats> stats(config.clients);
+	vector<thread> threads;
+	double start = now();
+	for(unsigned int c = 0; c < config.clients; c++)
+		threads.push_back(thread(runClient, ref(config), c, ref(stats[c])));
+	for(size_t c = 0; c < threads.size(); c++)
+		threads[c].join();
+	double elapsed = now() - start;
+
+	vector<double> all;
+	unsigned int errors = 0;
+	double service = 0;
+	for(unsigned int c = 0; c < config.clients; c++) {
+		all.insert(all.end(), stats[c].latencies.begin(), stats[c].latencies.end());
+		errors += stats[c].errors;
+		service += stats[c].service_us;
+	}
+	if(all.empty()) {
+		cerr << "No job completed" << endl;
+		return BAD_EXIT;
+	}
+	sort(all.begin(), all.end());
+	double sum = 0;
+	for(size_t k = 0; k < all.size(); k++)
+		sum += all[k];
+
+	printf("Jobs: %zu ok, %u failed, %u client(s), %ux%u, angle %u, %s\n", all.size(), errors,
+	       config.clients, config.width, config.height, config.angle, filter_names[config.filter]);
+	printf("Latency: p50 %.3fms  p99 %.3fms  mean %.3fms  max %.3fms\n", all[all.size() / 2] / 1000,
+	       all[(all.size() * 99) / 100] / 1000, sum / all.size() / 1000, all.back() / 1000);
+	printf("Service: mean %.3fms\n", service / all.size() / 1000);
+	printf("Throughput: %.1f req/s\n", all.size() / elapsed);
+	return errors == 0 ? 0 : BAD_EXIT;
+}
+
+/*
+*	Function: parseArgs
+*	-------------------
+*	Reads the socket path, the image size and the optional settings.
+*/
+bool parseArgs(int argc, char* argv[], LoadConfig &config) {
+	if(argc < 4)
+		return false;
+	config.socket = argv[1];
+	if(!parseCount(argv[2], MAX_DIMENSION, config.width) || !parseCount(argv[3], MAX_DIMENSION, config.height))
+		return false;
+	config.requests = 1000;
+	config.clients = 1;
+	config.angle = 30;
+	config.filter = 0;
+	config.thumb_w = config.thumb_h = 0;
+	for(int i = 4; i < argc; i++) {
+		string arg = argv[i];
+		if(i + 1 >= argc)
+			return false;
+		if(arg == "--requests") {
+			if(!parseCount(argv[++i], MAX_REQUESTS, config.requests))
+				return false;
+		}
+		else if(arg == "--clients") {
+			if(!parseCount(argv[++i], MAX_CLIENTS, config.clients))
+				return false;
+		}
+		else if(arg == "--angle")
+			config.angle = (atoi(argv[++i]) % 360 + 360) % 360;
+		else if(arg == "--filter") {
+			string name = argv[++i];
+			size_t f = 0;
+			while(f < 3 && name != filter_names[f])
+				f++;
+			if(f == 3)
+				return false;
+			config.filter = f;
+		}
+		else if(arg == "--thumb") {
+			if(sscanf(argv[++i], "%ux%u", &config.thumb_w, &config.thumb_h) != 2 ||
+			   config.thumb_w == 0 || config.thumb_h == 0)
+				return false;
+		}
+		else
+			return false;
+	}
+	return true;
+}
+
+/*
+*	Function: parseCount
+*	--------------------
+*	Reads a count that must lie between 1 and max. Parsed as signed, so
+*	negative values are refused instead of wrapping around.
+*/
+bool parseCount(const char* arg, int max, unsigned int &value) {
+	int count = atoi(arg);
+	if(count <= 0 || count > max)
+		return false;
+	value = count;
+	return true;
+}
+
+/*
+*	Function: runClient
+*	-------------------
+*	Connects to the daemon and sends config.requests jobs one after
+*	another, all sharing one memfd. The output area follows the input at
+*	the next page boundary and is large enough for any rotation angle.
+*/
+void runClient(const LoadConfig &config, unsigned int client, ClientStats &stats) {
+	stats.errors = 0;
+	stats.service_us = 0;
+
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, config.socket.c_str(), sizeof(addr.sun_path) - 1);
+	if(sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		stats.errors = config.requests;
+		if(sock >= 0)
+			close(sock);
+		return;
+	}
+
+	size_t in_size = (size_t)config.width * config.height * 3;
+	size_t out_offset = (in_size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+	size_t diagonal = config.width + config.height + 2;
+	size_t size = out_offset + diagonal * diagonal * 3;
+	int fd = memfd_create("rotload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	uint8_t *buffer = NULL;
+	/* The daemon only accepts buffers that cannot shrink under it */
+	if(fd >= 0 && ftruncate(fd, size) == 0 && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == 0) {
+		void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(mapping != MAP_FAILED)
+			buffer = (uint8_t*)mapping;
+	}
+	if(!buffer) {
+		perror("memfd");
+		stats.errors = config.requests;
+		if(fd >= 0)
+			close(fd);
+		close(sock);
+		return;
+	}
+	for(unsigned int y = 0; y < config.height; y++) {
+		uint8_t *row = buffer + (size_t)y * config.width * 3;
+		for(unsigned int x = 0; x < config.width; x++) {
+			row[3 * x] = x ^ y;
+			row[3 * x + 1] = (x + client * 64) & 0xff;
+			row[3 * x + 2] = y & 0xff;
+		}
+	}
+
+	JobRequest req;
+	memset(&req, 0, sizeof(req));
+	req.magic = ROT_MAGIC;
+	req.width = config.width;
+	req.height = config.height;
+	req.angle = config.angle;
+	req.filter = config.filter;
+	req.thumb_w = config.thumb_w;
+	req.thumb_h = config.thumb_h;
+	req.out_offset = out_offset;
+	req.buffer_size = size;
+	stats.latencies.reserve(config.requests);
+	for(unsigned int r = 0; r < config.requests; r++) {
+		JobReply reply;
+		int reply_fd;
+		req.id = r;
+		double start = now();
+		if(!sendMessage(sock, &req, sizeof(req), fd, 0) ||
+		   recvMessage(sock, &reply, sizeof(reply), &reply_fd) != sizeof(reply)) {
+			stats.errors += config.requests - r;
+			break;
+		}
+		double latency = now() - start;
+		if(reply.magic != ROT_MAGIC || reply.id != r || reply.status != JOB_OK) {
+			stats.errors++;
+			continue;
+		}
+		stats.latencies.push_back(latency * 1000000);
+		stats.service_us += reply.service_us;
+	}
+
+	munmap(buffer, size);
+	close(fd);
+	close(sock);
+}
+
+/*
+*	Function: now
+*	-------------
+*	Returns a monotonic time stamp in seconds.
+*/
+double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
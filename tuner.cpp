@@ -0,0 +1,241 @@
+/*
+*	"Image Rotate", a program to rotate images by a user-specifyable angle.
+*	
+*	Copyright (C) 2010 Michael Andersch
+*	
+*	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 3 of the License, or (at your option) any later version.
+*	
+*	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*	
+*	You should have received a copy of the GNU General Public License along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+*	File: tuner.cpp
+*	---------------
+*	Implementation of the kernel auto-tuner and the profile file.
+*/
+
+/* INCLUDES */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "tuner.h"
+
+/*
+*	Structure: TuneCase
+*	-------------------
+*	One synthetic workload of the tuning run.
+*/
+typedef struct {
+	unsigned int width, height, angle;
+} TuneCase;
+
+/*
+*	Small images stay in cache, large ones do not; the angles cover a
+*	right angle and two oblique ones of different orientation.
+*/
+static const TuneCase tune_cases[] = {
+	{640, 480, 17}, {640, 480, 90}, {640, 480, 233},
+	{3000, 2000, 17}, {3000, 2000, 90}, {3000, 2000, 233}
+};
+static const size_t num_tune_cases = sizeof(tune_cases)/sizeof(TuneCase);
+static const PixelLayout tune_layouts[] = {LAYOUT_INTERLEAVED, LAYOUT_PLANAR, LAYOUT_RGBX, LAYOUT_TILED};
+static const size_t num_tune_layouts = sizeof(tune_layouts)/sizeof(PixelLayout);
+static const unsigned int tune_tiles[] = {8, 16, 32, 64};
+static const size_t num_tune_tiles = sizeof(tune_tiles)/sizeof(unsigned int);
+
+static double now();
+static Pixel* syntheticImage(unsigned int width, unsigned int height);
+
+/*
+*	Function: profilePath
+*	---------------------
+*	Returns the profile file of this host: $ROT_PROFILE if set, otherwise
+*	~/.rot_profile.<hostname>, so hosts sharing a home directory keep
+*	separate profiles.
+*/
+string profilePath() {
+	const char *env = getenv("ROT_PROFILE");
+	if(env && *env)
+		return env;
+	char host[256];
+	if(gethostname(host, sizeof(host)) != 0)
+		strcpy(host, "localhost");
+	host[sizeof(host) - 1] = '\0';
+	const char *home = getenv("HOME");
+	return string(home ? home : ".") + "/.rot_profile." + host;
+}
+
+/*
+*	Function: loadProfile
+*	---------------------
+*	Reads the kernel settings stored in the profile at path into config.
+*	Settings missing from the file keep their value. Returns false if
+*	there is no readable profile.
+*/
+bool loadProfile(string path, KernelConfig &config) {
+	ifstream in(path.c_str());
+	if(!in.is_open())
+		return false;
+	KernelConfig loaded = config;
+	string line;
+	while(getline(in, line)) {
+		istringstream fields(line);
+		string key, value;
+		if(!(fields >> key >> value) || key[0] == '#')
+			continue;
+		if(key == "layout") {
+			for(size_t i = 0; i < num_tune_layouts; i++)
+				if(value == layoutName(tune_layouts[i]))
+					loaded.layout = tune_layouts[i];
+		}
+		else if(key == "tile") {
+			unsigned int size = atoi(value.c_str());
+			if(size >= TILE_SIZE_MIN && size <= TILE_SIZE_MAX && (size & (size - 1)) == 0)
+				loaded.tile_size = size;
+		}
+		else if(key == "threads") {
+			/* A bad value is ignored: every run loads the profile */
+			int threads = atoi(value.c_str());
+			if(threads > 0 && threads <= (int)maxWorkers())
+				loaded.threads = threads;
+		}
+	}
+	config = loaded;
+	return true;
+}
+
+/*
+*	Function: saveProfile
+*	---------------------
+*	Writes the kernel settings to the profile at path.
+*/
+bool saveProfile(string path, KernelConfig config) {
+	ofstream out(path.c_str());
+	if(!out.is_open()) {
+		cerr << "Unable to write profile " << path << endl;
+		return false;
+	}
+	time_t stamp = time(NULL);
+	char date[64];
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&stamp));
+	out << "# rot kernel profile, tuned " << date << " for " << filterName(config.filter) << endl;
+	out << "layout " << layoutName(config.layout) << endl;
+	out << "tile " << config.tile_size << endl;
+	out << "threads " << config.threads << endl;
+	return out.good();
+}
+
+/*
+*	Function: tuneKernel
+*	--------------------
+*	Times every layout, tile size and thread count on the synthetic
+*	workloads with the given filter and returns the settings with the
+*	highest geometric mean throughput. Thread counts are the powers of
+*	two up to the number of hardware threads, plus that number itself.
+*/
+KernelConfig tuneKernel(FilterMode filter) {
+	vector<unsigned int> thread_counts;
+	unsigned int cores = thread::hardware_concurrency();
+	if(cores == 0)
+		cores = 1;
+	for(unsigned int t = 1; t < cores; t *= 2)
+		thread_counts.push_back(t);
+	thread_counts.push_back(cores);
+
+	vector<KernelConfig> candidates;
+	for(size_t t = 0; t < thread_counts.size(); t++) {
+		for(size_t l = 0; l < num_tune_layouts; l++) {
+			KernelConfig config = defaultKernelConfig();
+			config.layout = tune_layouts[l];
+			config.filter = filter;
+			config.threads = thread_counts[t];
+			if(config.layout != LAYOUT_TILED) {
+				candidates.push_back(config);
+				continue;
+			}
+			for(size_t s = 0; s < num_tune_tiles; s++) {
+				config.tile_size = tune_tiles[s];
+				candidates.push_back(config);
+			}
+		}
+	}
+
+	vector<double> log_mps(candidates.size(), 0.0);
+	for(size_t c = 0; c < num_tune_cases; c++) {
+		const TuneCase &tc = tune_cases[c];
+		Pixel *pels = syntheticImage(tc.width, tc.height);
+		for(size_t k = 0; k < candidates.size(); k++) {
+			RotateEngine re;
+			re.init(pels, tc.width, tc.height, tc.angle, candidates[k]);
+			log_mps[k] += log(re.getMegapixels() / timeTrial(re));
+		}
+		delete[] pels;
+	}
+
+	size_t best = 0;
+	printf("%-12s %6s %8s %12s\n", "Layout", "Tile", "Threads", "MP/s");
+	for(size_t k = 0; k < candidates.size(); k++) {
+		printf("%-12s %6u %8u %12.2f\n", layoutName(candidates[k].layout), candidates[k].tile_size,
+		       candidates[k].threads, exp(log_mps[k] / num_tune_cases));
+		if(log_mps[k] > log_mps[best])
+			best = k;
+	}
+	return candidates[best];
+}
+
+/*
+*	Function: timeTrial
+*	-------------------
+*	Runs the engine once to warm caches, then repeatedly until at least
+*	TUNE_MIN_MSEC and TUNE_MIN_RUNS are reached. Returns the mean time
+*	of one run in seconds. Also used by the --bench table.
+*/
+double timeTrial(RotateEngine &re) {
+	re.run();
+	double start = now(), elapsed;
+	unsigned int runs = 0;
+	do {
+		re.run();
+		runs++;
+		elapsed = now() - start;
+	} while(runs < TUNE_MIN_RUNS || elapsed * 1000 < TUNE_MIN_MSEC);
+	return elapsed / runs;
+}
+
+/*
+*	Function: syntheticImage
+*	------------------------
+*	Returns a new image of the given size filled with a gradient pattern.
+*/
+static Pixel* syntheticImage(unsigned int width, unsigned int height) {
+	Pixel *pels = new Pixel[(size_t)width * height];
+	for(unsigned int y = 0; y < height; y++) {
+		for(unsigned int x = 0; x < width; x++) {
+			Pixel &p = pels[(size_t)y * width + x];
+			p.r = x ^ y;
+			p.g = x;
+			p.b = y;
+		}
+	}
+	return pels;
+}
+
+/*
+*	Function: now
+*	-------------
+*	Returns a monotonic time stamp in seconds.
+*/
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
@@ -0,0 +1,41 @@
+/*
+*	"Image Rotate", a program to rotate images by a user-specifyable angle.
+*	
+*	Copyright (C) 2010 Michael Andersch
+*	
+*	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 3 of the License, or (at your option) any later version.
+*	
+*	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*	
+*	You should have received a copy of the GNU General Public License along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+*	File: tuner.h
+*	-------------
+*	Header file for the kernel auto-tuner, which times the kernel
+*	settings on synthetic images and keeps the fastest ones in a
+*	per-host profile file.
+*/
+
+#ifndef TUNER_H
+#define TUNER_H
+
+/**********************************************************************************
+				INCLUDES & DEFINES
+***********************************************************************************/
+
+#include <string>
+#include "rotation_engine.h"
+
+#define TUNE_MIN_MSEC 40	/* minimum time spent timing one trial */
+#define TUNE_MIN_RUNS 2
+
+using namespace std;
+
+string profilePath();
+bool loadProfile(string path, KernelConfig &config);
+bool saveProfile(string path, KernelConfig config);
+KernelConfig tuneKernel(FilterMode filter);
+double timeTrial(RotateEngine &re);
+#endif
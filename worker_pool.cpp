@@ -0,0 +1,140 @@
+/*
+*	"Image Rotate", a program to rotate images by a user-specifyable angle.
+*	
+*	Copyright (C) 2010 Michael Andersch
+*	
+*	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 3 of the License, or (at your option) any later version.
+*	
+*	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*	
+*	You should have received a copy of the GNU General Public License along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+*	File: worker_pool.cpp
+*	---------------------
+*	Implementation of the worker pool.
+*/
+
+/* INCLUDES */
+#include "worker_pool.h"
+
+/*
+*	Function: maxWorkers
+*	--------------------
+*	Returns the largest worker count accepted from the user:
+*	WORKERS_PER_CORE workers per hardware thread.
+*/
+unsigned int maxWorkers() {
+	unsigned int cores = thread::hardware_concurrency();
+	return (cores > 0 ? cores : 1) * WORKERS_PER_CORE;
+}
+
+/*
+*	Function: Constructor
+*	---------------------
+*	Starts worker threads 1 to size - 1; the caller of run is worker 0.
+*/
+WorkerPool::WorkerPool(unsigned int size) {
+	this->size = (size > 0) ? size : 1;
+	num_tasks = next_task = pending = 0;
+	generation = 0;
+	stopping = false;
+	for(unsigned int w = 1; w < this->size; w++)
+		threads.push_back(thread(&WorkerPool::work, this, w));
+}
+
+/*
+*	Function: Destructor
+*	--------------------
+*	Stops and joins all worker threads.
+*/
+WorkerPool::~WorkerPool() {
+	{
+		unique_lock<mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for(size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+/*
+*	Function: getSize
+*	-----------------
+*	Returns the number of workers, including the calling thread.
+*/
+unsigned int WorkerPool::getSize() {
+	return size;
+}
+
+/*
+*	Function: run
+*	-------------
+*	Runs fn for every task in 0 .. tasks - 1 on the workers and returns
+*	when all of them are done. Not reentrant: only one thread may run
+*	jobs on a pool at a time.
+*/
+void WorkerPool::run(unsigned int tasks, function<void(unsigned int task, unsigned int worker)> fn) {
+	if(size == 1 || tasks <= 1) {
+		for(unsigned int t = 0; t < tasks; t++)
+			fn(t, 0);
+		return;
+	}
+	{
+		unique_lock<mutex> guard(lock);
+		job = fn;
+		num_tasks = pending = tasks;
+		next_task = 0;
+		generation++;
+	}
+	wake.notify_all();
+	drain(0);
+	unique_lock<mutex> guard(lock);
+	while(pending > 0)
+		finished.wait(guard);
+	job = NULL;
+}
+
+/*
+*	Function: work
+*	--------------
+*	Main loop of a worker thread: waits for a new job and helps draining
+*	its tasks until the pool is stopped.
+*/
+void WorkerPool::work(unsigned int worker) {
+	unsigned long seen = 0;
+	while(true) {
+		{
+			unique_lock<mutex> guard(lock);
+			while(!stopping && generation == seen)
+				wake.wait(guard);
+			if(stopping)
+				return;
+			seen = generation;
+		}
+		drain(worker);
+	}
+}
+
+/*
+*	Function: drain
+*	---------------
+*	Takes tasks of the current job and runs them until none are left.
+*/
+void WorkerPool::drain(unsigned int worker) {
+	while(true) {
+		unsigned int task;
+		{
+			unique_lock<mutex> guard(lock);
+			if(next_task >= num_tasks)
+				return;
+			task = next_task++;
+		}
+		/* job stays set until the last pending task is done */
+		job(task, worker);
+		unique_lock<mutex> guard(lock);
+		if(--pending == 0)
+			finished.notify_all();
+	}
+}
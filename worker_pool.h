@@ -0,0 +1,65 @@
+/*
+*	"Image Rotate", a program to rotate images by a user-specifyable angle.
+*	
+*	Copyright (C) 2010 Michael Andersch
+*	
+*	This program is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation; either version 3 of the License, or (at your option) any later version.
+*	
+*	This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*	
+*	You should have received a copy of the GNU General Public License along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+*	File: worker_pool.h
+*	-------------------
+*	Header file for the worker pool, a set of persistent threads the
+*	rotation kernel and the daemon distribute their work on.
+*/
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+/**********************************************************************************
+				INCLUDES & DEFINES
+***********************************************************************************/
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+#define WORKERS_PER_CORE 4	/* upper bound for requested thread counts */
+
+using namespace std;
+
+unsigned int maxWorkers();
+
+/*
+*	Class: WorkerPool
+*	-----------------
+*	A fixed number of workers that stay alive between jobs. A job is a
+*	number of tasks; each task is handed to one worker together with
+*	the worker's id, so callers can keep per-worker scratch state. The
+*	calling thread takes part as worker 0, so a pool of size 1 starts
+*	no threads at all.
+*/
+class WorkerPool {
+	public:
+		WorkerPool(unsigned int size);
+		~WorkerPool();
+		void run(unsigned int tasks, function<void(unsigned int task, unsigned int worker)> fn);
+		unsigned int getSize();
+	private:
+		vector<thread> threads;
+		mutex lock;
+		condition_variable wake, finished;
+		function<void(unsigned int, unsigned int)> job;
+		unsigned int size, num_tasks, next_task, pending;
+		unsigned long generation;
+		bool stopping;
+		void work(unsigned int worker);
+		void drain(unsigned int worker);
+};
+#endif